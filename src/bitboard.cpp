@@ -26,12 +26,22 @@ Bitboard bitMasks[64], pawnMasks[64][2], knightMasks[64], kingMasks[64], fileMas
         adjacentSouthMasks[64];
 LineType lineType[64][64];
 
+#if defined(DISPATCH)
+bool usePext = false;
+#endif
+
 /*
  * Initializes values, regarding bitboard. Must be called
  * before calling the move generator.
  */
 void initBitboard() {
 
+#if defined(DISPATCH)
+    // The magic tables have the same layout for both lookups, so PEXT can be selected before filling them.
+    __builtin_cpu_init();
+    usePext = __builtin_cpu_supports("bmi2");
+#endif
+
     for (Square sq = A1; sq < 64; sq += 1) {
         bitMasks[sq] = 1ULL << sq;
 
@@ -131,6 +141,16 @@ Bitboard slidingAttacks(Square square, Bitboard occupied, PieceType type) {
     }
 }
 
+const char *getSliderLookupName() {
+#if defined(BMI2)
+    return "pext";
+#elif defined(DISPATCH)
+    return usePext ? "pext" : "magic";
+#else
+    return "magic";
+#endif
+}
+
 // Initializes magic bitboards.
 void initMagic(const Magic *magics, PieceType type) {
     assert((type == ROOK) || (type == BISHOP));
@@ -359,15 +359,31 @@ extern LineType lineType[64][64];
 
 void initBitboard();
 
+// Returns the name of the method used for looking up slider attacks.
+const char *getSliderLookupName();
+
+#if defined(DISPATCH)
+// True if PEXT was found to be supported by the CPU in initBitboard().
+extern bool usePext;
+
+inline __attribute__((target("bmi2"))) unsigned int pextIndex(U64 occ, U64 mask) {
+    return _pext_u64(occ, mask);
+}
+#endif
+
 inline Bitboard::Bitboard(Square square) {
     bb = bitMasks[square].bb;
 }
 
 // Converts the magic and the occupancy bitboard into an index in the lookup table.
 inline unsigned int getMagicIndex(const Magic &m, Bitboard occ) {
-#ifdef BMI2
+#if defined(BMI2)
     return _pext_u64(occ.bb, m.mask.bb);
 #else
+#if defined(DISPATCH)
+    if (usePext)
+        return pextIndex(occ.bb, m.mask.bb);
+#endif
     return (((occ & m.mask) * m.magic) >> (64 - m.shift)).bb;
 #endif
 }
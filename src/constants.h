@@ -30,6 +30,10 @@
 #define AVX2
 #endif
 
+#if defined(NATIVE) && defined(__AVX512BW__)
+#define AVX512
+#endif
+
 typedef uint64_t U64;
 typedef int32_t Score;
 typedef int8_t Depth;
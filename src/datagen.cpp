@@ -20,6 +20,7 @@
 #include "position.h"
 #include "search.h"
 
+#include <chrono>
 #include <fstream>
 #include <random>
 #include <utility>
@@ -69,9 +70,7 @@ void playGame(Position &pos, std::vector<DataEntry> &entries) {
         Color stm = pos.getSideToMove();
         bool inCheck = bool(getAttackers(pos, pos.pieces<KING>(stm).lsb()));
 
-        Move moves[200];
-        int cnt = generateMoves(pos, moves, false) - moves;
-        if (cnt == 0) {
+        if (!hasLegalMove(pos)) {
             if (inCheck) {
                 wdl = stm == WHITE ? 1 : -1;
             } else {
@@ -163,6 +162,7 @@ void startDataGen(int entryCount, int id) {
     auto start = std::chrono::system_clock::now();
     while (finished < entryCount) {
         entries.clear();
+        clearHistory();
 
         playGame(pos, entries);
 
@@ -25,5 +25,6 @@ constexpr Score PIECE_VALUES[7] = {
 
 // Returns the score of a position using NNUE.
 inline Score eval(const Position &pos) {
-    return pos.getState()->accumulator.forward(pos.getSideToMove());
+    pos.updateAccumulator();
+    return pos.getState()->accumulator.forward(pos.getSideToMove(), pos.occupied().popCount());
 }
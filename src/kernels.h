@@ -0,0 +1,311 @@
+// BlackCore is a chess engine
+// Copyright (c) 2022-2023 SzilBalazs
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/*
+ * NNUE kernels
+ *
+ * Included by nnue.cpp inside a namespace once for every instruction set it is compiled for,
+ * which is why this file has no include guard. The instruction set is selected with the AVX2 and AVX512 defines.
+ */
+
+// Copies a hidden layer of L_1_SIZE neurons.
+inline void copyLayer(int16_t *output, const int16_t *input) {
+#ifdef AVX2
+    for (int i = 0; i < chunkNum; i += 4) {
+        const int offset1 = (i + 0) * regWidth;
+        const int offset2 = (i + 1) * regWidth;
+        const int offset3 = (i + 2) * regWidth;
+        const int offset4 = (i + 3) * regWidth;
+
+        __m256i ac1 = _mm256_load_si256((__m256i *) &input[offset1]);
+        __m256i ac2 = _mm256_load_si256((__m256i *) &input[offset2]);
+        __m256i ac3 = _mm256_load_si256((__m256i *) &input[offset3]);
+        __m256i ac4 = _mm256_load_si256((__m256i *) &input[offset4]);
+
+        _mm256_store_si256((__m256i *) &output[offset1], ac1);
+        _mm256_store_si256((__m256i *) &output[offset2], ac2);
+        _mm256_store_si256((__m256i *) &output[offset3], ac3);
+        _mm256_store_si256((__m256i *) &output[offset4], ac4);
+    }
+#else
+    std::memcpy(output, input, sizeof(int16_t) * L_1_SIZE);
+#endif
+}
+
+// Adds the L_0 weights of a feature to a hidden layer.
+inline void addWeights(int16_t *layer, unsigned int index) {
+#ifdef AVX2
+    for (int i = 0; i < chunkNum; i++) {
+        const int offset = i * regWidth;
+        __m256i ac = _mm256_load_si256((__m256i *) &layer[offset]);
+        __m256i we = _mm256_load_si256((__m256i *) &L_0_WEIGHTS[index * L_1_SIZE + offset]);
+        __m256i sum = _mm256_add_epi16(ac, we);
+        _mm256_store_si256((__m256i *) &layer[offset], sum);
+    }
+#else
+    for (int i = 0; i < L_1_SIZE; i++) {
+        layer[i] += L_0_WEIGHTS[index * L_1_SIZE + i];
+    }
+#endif
+}
+
+// Subtracts the L_0 weights of a feature from a hidden layer.
+inline void subWeights(int16_t *layer, unsigned int index) {
+#ifdef AVX2
+    for (int i = 0; i < chunkNum; i++) {
+        const int offset = i * regWidth;
+        __m256i ac = _mm256_load_si256((__m256i *) &layer[offset]);
+        __m256i we = _mm256_load_si256((__m256i *) &L_0_WEIGHTS[index * L_1_SIZE + offset]);
+        __m256i sum = _mm256_sub_epi16(ac, we);
+        _mm256_store_si256((__m256i *) &layer[offset], sum);
+    }
+#else
+    for (int i = 0; i < L_1_SIZE; i++) {
+        layer[i] -= L_0_WEIGHTS[index * L_1_SIZE + i];
+    }
+#endif
+}
+
+// Computes the hidden layer of a child from the hidden layer of its parent, by adding and subtracting
+// the weights of the changed features. The hidden layer is loaded and stored only once.
+template<int addCount, int removeCount>
+inline void updateLayerFused(int16_t *output, const int16_t *input, const unsigned int *added, const unsigned int *removed) {
+#ifdef AVX2
+    for (int i = 0; i < chunkNum; i++) {
+        const int offset = i * regWidth;
+        __m256i ac = _mm256_load_si256((__m256i *) &input[offset]);
+        for (int j = 0; j < addCount; j++) {
+            ac = _mm256_add_epi16(ac, _mm256_load_si256((__m256i *) &L_0_WEIGHTS[added[j] * L_1_SIZE + offset]));
+        }
+        for (int j = 0; j < removeCount; j++) {
+            ac = _mm256_sub_epi16(ac, _mm256_load_si256((__m256i *) &L_0_WEIGHTS[removed[j] * L_1_SIZE + offset]));
+        }
+        _mm256_store_si256((__m256i *) &output[offset], ac);
+    }
+#else
+    for (int i = 0; i < L_1_SIZE; i++) {
+        int16_t value = input[i];
+        for (int j = 0; j < addCount; j++) {
+            value += L_0_WEIGHTS[added[j] * L_1_SIZE + i];
+        }
+        for (int j = 0; j < removeCount; j++) {
+            value -= L_0_WEIGHTS[removed[j] * L_1_SIZE + i];
+        }
+        output[i] = value;
+    }
+#endif
+}
+
+// Applies the changed features of a move. Quiet moves and promotions, captures and castling have their own
+// fused kernels, anything else is copied and updated feature by feature.
+inline void updateLayer(int16_t *output, const int16_t *input, const unsigned int *added, int addCount,
+                        const unsigned int *removed, int removeCount) {
+    if (addCount == 1 && removeCount == 1) {
+        updateLayerFused<1, 1>(output, input, added, removed);
+    } else if (addCount == 1 && removeCount == 2) {
+        updateLayerFused<1, 2>(output, input, added, removed);
+    } else if (addCount == 2 && removeCount == 2) {
+        updateLayerFused<2, 2>(output, input, added, removed);
+    } else {
+        copyLayer(output, input);
+        for (int i = 0; i < removeCount; i++) {
+            subWeights(output, removed[i]);
+        }
+        for (int i = 0; i < addCount; i++) {
+            addWeights(output, added[i]);
+        }
+    }
+}
+
+#if defined(AVX2)
+// Returns the sum of the 32-bit lanes of a register.
+inline int32_t horizontalAdd(__m256i sum) {
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4E));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xB1));
+    return _mm_cvtsi128_si32(sum128);
+}
+#endif
+
+// Returns the dot product of an activated hidden layer and the L_1 weights belonging to it.
+inline int32_t activate(const int16_t *input, const int16_t *weights) {
+#if defined(AVX512)
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i sum = _mm512_setzero_si512();
+
+    for (int i = 0; i < L_1_SIZE; i += 32) {
+        __m512i in = _mm512_max_epi16(_mm512_load_si512((__m512i *) &input[i]), zero);
+        __m512i we = _mm512_load_si512((__m512i *) &weights[i]);
+        sum = _mm512_add_epi32(sum, _mm512_madd_epi16(in, we));
+    }
+
+    return _mm512_reduce_add_epi32(sum);
+#elif defined(AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    __m256i sum2 = _mm256_setzero_si256();
+
+    for (int i = 0; i < chunkNum; i += 2) {
+        const int offset1 = (i + 0) * regWidth;
+        const int offset2 = (i + 1) * regWidth;
+
+        __m256i in1 = _mm256_max_epi16(_mm256_load_si256((__m256i *) &input[offset1]), zero);
+        __m256i in2 = _mm256_max_epi16(_mm256_load_si256((__m256i *) &input[offset2]), zero);
+        __m256i we1 = _mm256_load_si256((__m256i *) &weights[offset1]);
+        __m256i we2 = _mm256_load_si256((__m256i *) &weights[offset2]);
+
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(in1, we1));
+        sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(in2, we2));
+    }
+
+    return horizontalAdd(_mm256_add_epi32(sum1, sum2));
+#else
+    return activateReference(input, weights);
+#endif
+}
+
+// Returns the dot product of a hidden layer activated by clipped ReLU and int8 L_1 weights.
+inline int32_t activateInt8(const int16_t *input, const int8_t *weights) {
+#if defined(AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (int i = 0; i < L_1_SIZE; i += 32) {
+        __m256i in1 = _mm256_load_si256((__m256i *) &input[i]);
+        __m256i in2 = _mm256_load_si256((__m256i *) &input[i + 16]);
+
+        // Saturating to int8 and clamping at zero clips the neurons to [0, 127], the permute
+        // restores the order changed by the lane-wise packing.
+        __m256i packed = _mm256_max_epi8(_mm256_packs_epi16(in1, in2), zero);
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+
+        __m256i we = _mm256_load_si256((__m256i *) &weights[i]);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(packed, we), ones));
+    }
+
+    return horizontalAdd(sum);
+#else
+    return activateInt8Reference(input, weights);
+#endif
+}
+
+// Activates the hidden layer by clipped ReLU and packs it into bytes.
+inline void packHidden(const int16_t *input, uint8_t *output) {
+#if defined(AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int i = 0; i < L_1_SIZE; i += 32) {
+        __m256i in1 = _mm256_load_si256((__m256i *) &input[i]);
+        __m256i in2 = _mm256_load_si256((__m256i *) &input[i + 16]);
+        __m256i packed = _mm256_max_epi8(_mm256_packs_epi16(in1, in2), zero);
+        _mm256_store_si256((__m256i *) &output[i], _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+#else
+    packHiddenReference(input, output);
+#endif
+}
+
+#if defined(AVX2)
+// Writes the indices of the non-zero 4 byte blocks of the input and returns their count. Every step
+// stores 8 indices, so the output needs room for 8 more of them than the number of blocks.
+inline int findNonZeroBlocks(const uint8_t *input, int inputSize, uint16_t *indices) {
+    const __m128i step = _mm_set1_epi16(8);
+    __m128i base = _mm_setzero_si128();
+    int count = 0;
+
+    auto append = [&](unsigned int mask) {
+        __m128i lookup = _mm_loadu_si128((__m128i *) NON_ZERO_INDICES[mask].data());
+        _mm_storeu_si128((__m128i *) &indices[count], _mm_add_epi16(base, lookup));
+        count += __builtin_popcount(mask);
+        base = _mm_add_epi16(base, step);
+    };
+
+#if defined(AVX512)
+    for (int i = 0; i < inputSize; i += 64) {
+        __m512i in = _mm512_load_si512((__m512i *) &input[i]);
+        unsigned int mask = _mm512_test_epi32_mask(in, in);
+        append(mask & 0xFF);
+        append(mask >> 8);
+    }
+#else
+    const __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < inputSize; i += 32) {
+        __m256i in = _mm256_load_si256((__m256i *) &input[i]);
+        __m256i isZero = _mm256_cmpeq_epi32(in, zero);
+        append(~_mm256_movemask_ps(_mm256_castsi256_ps(isZero)) & 0xFF);
+    }
+#endif
+
+    return count;
+}
+#endif
+
+// Propagates a mostly zero input through a dense layer, whose weights are stored in blocks of 4 inputs
+// for every output. Only the columns of the non-zero blocks are multiplied.
+inline void affineSparse(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                         int32_t *output, int outputSize) {
+#if defined(AVX2)
+    constexpr int maxRegisters = 8;
+    const __m256i ones = _mm256_set1_epi16(1);
+    const int registerCount = outputSize / 8;
+    __m256i sums[maxRegisters];
+
+    for (int j = 0; j < registerCount; j++) {
+        sums[j] = _mm256_loadu_si256((__m256i *) &biases[j * 8]);
+    }
+
+    alignas(64) uint16_t nonZero[2 * L_1_SIZE / 4 + 8];
+    const int nonZeroCount = findNonZeroBlocks(input, inputSize, nonZero);
+
+    const int32_t *blocks = reinterpret_cast<const int32_t *>(input);
+    for (int k = 0; k < nonZeroCount; k++) {
+        const int block = nonZero[k];
+        const __m256i in = _mm256_set1_epi32(blocks[block]);
+        const int8_t *column = &weights[block * outputSize * 4];
+        for (int j = 0; j < registerCount; j++) {
+            __m256i we = _mm256_load_si256((__m256i *) &column[j * 32]);
+            sums[j] = _mm256_add_epi32(sums[j], _mm256_madd_epi16(_mm256_maddubs_epi16(in, we), ones));
+        }
+    }
+
+    for (int j = 0; j < registerCount; j++) {
+        _mm256_storeu_si256((__m256i *) &output[j * 8], sums[j]);
+    }
+#else
+    affineSparseReference(input, inputSize, weights, biases, output, outputSize);
+#endif
+}
+
+// Propagates an input through a dense layer, whose weights are stored row by row for every output.
+inline void affineDense(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                        int32_t *output, int outputSize) {
+#if defined(AVX2)
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    for (int o = 0; o < outputSize; o++) {
+        __m256i sum = _mm256_setzero_si256();
+        for (int i = 0; i < inputSize; i += 32) {
+            __m256i in = _mm256_load_si256((__m256i *) &input[i]);
+            __m256i we = _mm256_load_si256((__m256i *) &weights[o * inputSize + i]);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(in, we), ones));
+        }
+        output[o] = biases[o] + horizontalAdd(sum);
+    }
+#else
+    affineDenseReference(input, inputSize, weights, biases, output, outputSize);
+#endif
+}
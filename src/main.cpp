@@ -19,6 +19,8 @@
 #include "tools.h"
 #include "uci.h"
 
+#include <thread>
+
 #ifdef _WIN64
 #include <windows.h>
 #endif
@@ -48,10 +50,33 @@ int main(int argc, char **argv) {
         int entryCount = std::stoi(argv[2]);
         int threadId = std::stoi(argv[3]);
         startDataGen(entryCount, threadId);
+    } else if (mode == "bench" && argc >= 3 && std::string(argv[2]) == "sparse") {
+        benchSparse();
+    } else if (mode == "bench" && argc >= 3 && std::string(argv[2]) == "ordering") {
+        benchMoveOrdering();
     } else if (mode == "bench") {
         testSearch(argc >= 3 ? std::stoi(argv[2]) : 0);
     } else if (mode == "perft") {
-        testPerft();
+        unsigned int threadCount = argc >= 3 ? std::stoi(argv[2]) : std::max(1U, std::thread::hardware_concurrency());
+        unsigned int hashSize = argc >= 4 ? std::stoi(argv[3]) : PERFT_HASH_SIZE;
+        testPerft(threadCount, hashSize);
+    } else if (mode == "ttstress") {
+        testTT(argc >= 3 ? std::stoi(argv[2]) : 8);
+    } else if (mode == "nnue") {
+        testNNUE();
+    } else if (mode == "convertnet") {
+        if (argc < 4) {
+            std::cout << "./BlackCore convertnet input output [int8|mirror]" << std::endl;
+            return 0;
+        }
+        NNUE::init();
+        std::string conversion = argc >= 5 ? argv[4] : "";
+        NNUE::NetConversion netConversion = conversion == "int8"     ? NNUE::INT8_OUTPUT
+                                            : conversion == "mirror" ? NNUE::MIRRORED_INPUT
+                                                                     : NNUE::NO_CONVERSION;
+        if (NNUE::loadNet(argv[2]) && NNUE::writeNet(argv[3], netConversion)) {
+            std::cout << "Net written to " << argv[3] << std::endl;
+        }
     } else if (mode == "filter") {
         processPlain(argv[2]);
     } else {
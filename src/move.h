@@ -57,9 +57,17 @@ public:
         data = (from << 6) | (to);
     }
 
+    // Initialize the move from its raw encoding
+    constexpr explicit Move(uint16_t data) : data(data) {}
+
     // Default constructor, initialize move as null move
     constexpr Move() = default;
 
+    // Returns the raw encoding of the move
+    constexpr uint16_t getData() const {
+        return data;
+    }
+
     // Returns the to square of the move
     constexpr Square getTo() const {
         return Square(data & 0x3f);
@@ -16,6 +16,30 @@
 
 #include "movegen.h"
 
+#if defined(DISPATCH)
+bool useVectorSelect = false;
+#endif
+
+// Selects the vectorized best move selection, if the CPU supports it.
+void initMoveSelection() {
+#if defined(DISPATCH)
+    __builtin_cpu_init();
+    useVectorSelect = __builtin_cpu_supports("avx2");
+#endif
+}
+
+const char *getMoveSelectionName() {
+#if defined(AVX512)
+    return "avx512";
+#elif defined(AVX2)
+    return "avx2";
+#elif defined(DISPATCH)
+    return useVectorSelect ? "avx2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
 // Generates all promotion moves for a pawn from 'from' to 'to'
 // and adds them to the move list 'moves'
 inline Move *makePromo(Move *moves, Square from, Square to) {
@@ -61,7 +85,7 @@ inline Bitboard getAttackedSquares(const Position &pos, Bitboard occupied) {
 }
 
 // Generates all legal moves for the given pieces
-// 'capturesOnly' - if true, only generates capture moves
+// 'type' - the kind of moves to generate
 // 'pinHV' - if true, pieces are pinned horizontally or vertically
 // 'pinDA' - if true, pieces are pinned diagonally or anti-diagonally
 // 'pieces' - bitboard of the pieces to generate moves for
@@ -69,7 +93,7 @@ inline Bitboard getAttackedSquares(const Position &pos, Bitboard occupied) {
 // 'occupied' - a bitboard of all occupied squares
 // 'empty' - a bitboard of all empty squares
 // 'enemy' - a bitboard of all enemy pieces
-template<bool capturesOnly, bool pinHV, bool pinDA>
+template<GenType type, bool pinHV, bool pinDA>
 inline Move *generateMovesFromPieces(const Position &pos, Move *moves, Bitboard pieces, Bitboard specialMask,
                                      Bitboard occupied, Bitboard empty, Bitboard enemy) {
 
@@ -77,10 +101,10 @@ inline Move *generateMovesFromPieces(const Position &pos, Move *moves, Bitboard
     while (pieces) {
 
         Square from = pieces.popLsb();
-        PieceType type = pos.pieceAt(from).type;
+        PieceType pieceType = pos.pieceAt(from).type;
 
         // Get the attacks of the piece and filter by the special mask
-        Bitboard attacks = pieceAttacks(type, from, occupied) & specialMask;
+        Bitboard attacks = pieceAttacks(pieceType, from, occupied) & specialMask;
 
         // Check if the piece is pinned horizontally or vertically
         if constexpr (pinHV)
@@ -90,8 +114,8 @@ inline Move *generateMovesFromPieces(const Position &pos, Move *moves, Bitboard
         if constexpr (pinDA)
             attacks &= bishopMasks[from];
 
-        // If we're not generating captures only, generate quiet moves
-        if constexpr (!capturesOnly) {
+        // Generate quiet moves
+        if constexpr (type != GEN_CAPTURES) {
             Bitboard quiets = attacks & empty;
             while (quiets) {
                 *moves++ = Move(from, quiets.popLsb());
@@ -99,28 +123,26 @@ inline Move *generateMovesFromPieces(const Position &pos, Move *moves, Bitboard
         }
 
         // Generate captures
-        Bitboard captures = attacks & enemy;
-        while (captures) {
-            Square to = captures.popLsb();
-            *moves++ = Move(from, to, CAPTURE);
+        if constexpr (type != GEN_QUIETS) {
+            Bitboard captures = attacks & enemy;
+            while (captures) {
+                Square to = captures.popLsb();
+                *moves++ = Move(from, to, CAPTURE);
+            }
         }
     }
 
     return moves;
 }
 
-// Generates all legal pawn moves for all the 'color' pawns in 'pos' position and
-// adds them to the 'moves' move list.
-// 'capturesOnly' - if true, only generates capture moves
+// Generates the legal en passant captures. As two pawns leave their squares, the rank and the diagonals of
+// the captured pawn are checked for a slider attacking the king.
 // 'king' - the square where the friendly king is
 // 'checkMask' - a bitboard indicating to squares which evade check
-// 'moveH' - a bitboard indicating pieces which can move horizontally
-// 'moveV' - a bitboard indicating pieces which can move vertically
 // 'moveD' - a bitboard indicating pieces which can move diagonally
 // 'moveA' - a bitboard indicating pieces which can move anti-diagonally
-template<Color color, bool capturesOnly>
-Move *generatePawnMoves(const Position &pos, Move *moves, Square king, Bitboard checkMask,
-                        Bitboard moveH, Bitboard moveV, Bitboard moveD, Bitboard moveA) {
+template<Color color>
+inline Move *generateEpMoves(const Position &pos, Move *moves, Square king, Bitboard checkMask, Bitboard moveD, Bitboard moveA) {
 
     // Define enemy color
     constexpr Color enemyColor = EnemyColor<color>();
@@ -133,99 +155,11 @@ Move *generatePawnMoves(const Position &pos, Move *moves, Square king, Bitboard
     constexpr Direction DOWN_LEFT = -UP_RIGHT;
     constexpr Direction DOWN_RIGHT = -UP_LEFT;
 
-    // Define ranks for double pawn push and promotion
-    constexpr Bitboard doublePushRank = (color == WHITE ? rank3 : rank6);
-    constexpr Bitboard beforePromoRank = (color == WHITE ? rank7 : rank2);
-
-    // Create a bitboard of squares not on the promotion rank
-    constexpr Bitboard notBeforePromo = ~beforePromoRank;
-
-    // Get the en passant square
     Square epSquare = pos.getEpSquare();
-
-    // Get the empty and the enemy bitboards
-    Bitboard empty = pos.empty();
-    Bitboard enemy = pos.enemy<color>();
-
-    // Get the bitboard of pawns to generate moves for
     Bitboard pawns = pos.pieces<color, PAWN>();
 
-    // Get the bitboard of pawns before promotion
-    Bitboard pawnsBeforePromo = beforePromoRank & pawns;
-    pawns &= notBeforePromo;
-
-    // Generate quiet moves
-    if constexpr (!capturesOnly) {
-
-        Bitboard singlePush = step<UP>(pawns & moveH) & empty;               // Generates single pawn pushes
-        Bitboard doublePush = step<UP>(singlePush & doublePushRank) & empty; // Generates double pawn pushes
-
-        // Filter out moves that are within the 'checkMask'
-        singlePush &= checkMask;
-        doublePush &= checkMask;
-
-        // Iterate through single pawn pushes
-        while (singlePush) {
-            Square to = singlePush.popLsb();
-            *moves++ = Move(to + DOWN, to);
-        }
-
-        // Iterate through double pawn pushes
-        while (doublePush) {
-            Square to = doublePush.popLsb();
-            *moves++ = Move(to + (2 * DOWN), to, DOUBLE_PAWN_PUSH);
-        }
-    }
-
-    // Filter out all the legal capture moves to the right
-    Bitboard rightCapture = step<UP_RIGHT>(pawns & moveD) & enemy & checkMask;
-    // Filter out all the legal capture moves to the left
-    Bitboard leftCapture = step<UP_LEFT>(pawns & moveA) & enemy & checkMask;
-
-    // Iterate through left captures
-    while (leftCapture) {
-        Square to = leftCapture.popLsb();
-        *moves++ = Move(to + DOWN_RIGHT, to, CAPTURE);
-    }
-
-    // Iterate through right captures
-    while (rightCapture) {
-        Square to = rightCapture.popLsb();
-        *moves++ = Move(to + DOWN_LEFT, to, CAPTURE);
-    }
-
-    // Check if there are any pawns that can be promoted
-    if (pawnsBeforePromo) {
-
-        // Generate quiet moves
-        if constexpr (!capturesOnly) {
-            // Filter out all the legal promotions upwards
-            Bitboard upPromo = step<UP>(pawnsBeforePromo & moveH) & empty & checkMask;
-
-            while (upPromo) {
-                Square to = upPromo.popLsb();
-                moves = makePromo(moves, to + DOWN, to);
-            }
-        }
-
-        // Filter out all the legal sideways capture-promotions
-        Bitboard rightPromo = step<UP_RIGHT>(pawnsBeforePromo & moveD) & enemy & checkMask;
-        Bitboard leftPromo = step<UP_LEFT>(pawnsBeforePromo & moveA) & enemy & checkMask;
-
-        while (rightPromo) {
-            Square to = rightPromo.popLsb();
-            moves = makePromoCapture(moves, to + DOWN_LEFT, to);
-        }
-
-        while (leftPromo) {
-            Square to = leftPromo.popLsb();
-            moves = makePromoCapture(moves, to + DOWN_RIGHT, to);
-        }
-    }
-
     // Check if the epSquare is not empty, if there is an en-passantable pawn and if the epSquare is within the check mask
-    if ((epSquare != NULL_SQUARE) && (pawnMasks[pos.getEpSquare()][enemyColor] & pawns) &&
-        checkMask.get(epSquare + DOWN)) {
+    if ((epSquare != NULL_SQUARE) && (pawnMasks[epSquare][enemyColor] & pawns) && checkMask.get(epSquare + DOWN)) {
 
         // Get the occupied squares
         Bitboard occ = pos.occupied();
@@ -303,15 +237,134 @@ Move *generatePawnMoves(const Position &pos, Move *moves, Square king, Bitboard
     return moves;
 }
 
+// Generates all legal pawn moves for all the 'color' pawns in 'pos' position and
+// adds them to the 'moves' move list.
+// 'type' - the kind of moves to generate
+// 'king' - the square where the friendly king is
+// 'checkMask' - a bitboard indicating to squares which evade check
+// 'moveH' - a bitboard indicating pieces which can move horizontally
+// 'moveV' - a bitboard indicating pieces which can move vertically
+// 'moveD' - a bitboard indicating pieces which can move diagonally
+// 'moveA' - a bitboard indicating pieces which can move anti-diagonally
+template<Color color, GenType type>
+Move *generatePawnMoves(const Position &pos, Move *moves, Square king, Bitboard checkMask,
+                        Bitboard moveH, Bitboard moveV, Bitboard moveD, Bitboard moveA) {
+
+    // Define move directions
+    constexpr Direction UP = color == WHITE ? NORTH : -NORTH;
+    constexpr Direction UP_LEFT = color == WHITE ? NORTH_WEST : -NORTH_WEST;
+    constexpr Direction UP_RIGHT = color == WHITE ? NORTH_EAST : -NORTH_EAST;
+    constexpr Direction DOWN = -UP;
+    constexpr Direction DOWN_LEFT = -UP_RIGHT;
+    constexpr Direction DOWN_RIGHT = -UP_LEFT;
+
+    // Define ranks for double pawn push and promotion
+    constexpr Bitboard doublePushRank = (color == WHITE ? rank3 : rank6);
+    constexpr Bitboard beforePromoRank = (color == WHITE ? rank7 : rank2);
+
+    // Create a bitboard of squares not on the promotion rank
+    constexpr Bitboard notBeforePromo = ~beforePromoRank;
+
+    // Get the empty and the enemy bitboards
+    Bitboard empty = pos.empty();
+    Bitboard enemy = pos.enemy<color>();
+
+    // Get the bitboard of pawns to generate moves for
+    Bitboard pawns = pos.pieces<color, PAWN>();
+
+    // Get the bitboard of pawns before promotion
+    Bitboard pawnsBeforePromo = beforePromoRank & pawns;
+    pawns &= notBeforePromo;
+
+    // Generate quiet moves
+    if constexpr (type != GEN_CAPTURES) {
+
+        Bitboard singlePush = step<UP>(pawns & moveH) & empty;               // Generates single pawn pushes
+        Bitboard doublePush = step<UP>(singlePush & doublePushRank) & empty; // Generates double pawn pushes
+
+        // Filter out moves that are within the 'checkMask'
+        singlePush &= checkMask;
+        doublePush &= checkMask;
+
+        // Iterate through single pawn pushes
+        while (singlePush) {
+            Square to = singlePush.popLsb();
+            *moves++ = Move(to + DOWN, to);
+        }
+
+        // Iterate through double pawn pushes
+        while (doublePush) {
+            Square to = doublePush.popLsb();
+            *moves++ = Move(to + (2 * DOWN), to, DOUBLE_PAWN_PUSH);
+        }
+    }
+
+    if constexpr (type != GEN_QUIETS) {
+        // Filter out all the legal capture moves to the right
+        Bitboard rightCapture = step<UP_RIGHT>(pawns & moveD) & enemy & checkMask;
+        // Filter out all the legal capture moves to the left
+        Bitboard leftCapture = step<UP_LEFT>(pawns & moveA) & enemy & checkMask;
+
+        // Iterate through left captures
+        while (leftCapture) {
+            Square to = leftCapture.popLsb();
+            *moves++ = Move(to + DOWN_RIGHT, to, CAPTURE);
+        }
+
+        // Iterate through right captures
+        while (rightCapture) {
+            Square to = rightCapture.popLsb();
+            *moves++ = Move(to + DOWN_LEFT, to, CAPTURE);
+        }
+    }
+
+    // Check if there are any pawns that can be promoted
+    if (pawnsBeforePromo) {
+
+        // Generate quiet moves
+        if constexpr (type != GEN_CAPTURES) {
+            // Filter out all the legal promotions upwards
+            Bitboard upPromo = step<UP>(pawnsBeforePromo & moveH) & empty & checkMask;
+
+            while (upPromo) {
+                Square to = upPromo.popLsb();
+                moves = makePromo(moves, to + DOWN, to);
+            }
+        }
+
+        // Filter out all the legal sideways capture-promotions
+        if constexpr (type != GEN_QUIETS) {
+            Bitboard rightPromo = step<UP_RIGHT>(pawnsBeforePromo & moveD) & enemy & checkMask;
+            Bitboard leftPromo = step<UP_LEFT>(pawnsBeforePromo & moveA) & enemy & checkMask;
+
+            while (rightPromo) {
+                Square to = rightPromo.popLsb();
+                moves = makePromoCapture(moves, to + DOWN_LEFT, to);
+            }
+
+            while (leftPromo) {
+                Square to = leftPromo.popLsb();
+                moves = makePromoCapture(moves, to + DOWN_RIGHT, to);
+            }
+        }
+    }
+
+    // Generate en passant captures
+    if constexpr (type != GEN_QUIETS)
+        moves = generateEpMoves<color>(pos, moves, king, checkMask, moveD, moveA);
+
+    return moves;
+}
+
 // Generates all the legal king moves.
-template<bool capturesOnly>
+template<GenType type>
 inline Move *generateKingMoves(const Position &pos, Move *moves, Square king,
                                Bitboard safeSquares, Bitboard empty, Bitboard enemy) {
 
     // Calculate all safe squares that the king can move to
     Bitboard kingTarget = kingMasks[king] & safeSquares;
 
-    if constexpr (!capturesOnly) {
+    if constexpr (type != GEN_CAPTURES) {
 
         // Generate all legal king moves to squares that are empty
         Bitboard kingQuiets = kingTarget & empty;
@@ -322,11 +375,13 @@ inline Move *generateKingMoves(const Position &pos, Move *moves, Square king,
     }
 
     // Generate all legal king moves to squares that contain enemy pieces
-    Bitboard kingCaptures = kingTarget & enemy;
+    if constexpr (type != GEN_QUIETS) {
+        Bitboard kingCaptures = kingTarget & enemy;
 
-    while (kingCaptures) {
-        Square to = kingCaptures.popLsb();
-        *moves++ = Move(king, to, CAPTURE);
+        while (kingCaptures) {
+            Square to = kingCaptures.popLsb();
+            *moves++ = Move(king, to, CAPTURE);
+        }
     }
 
     return moves;
@@ -351,7 +406,7 @@ inline Bitboard generateCheckMask(const Position &pos, Square king, Bitboard che
 }
 
 // Generates all the legal slider and knight moves using the generateMovesFromPieces utility.
-template<bool capturesOnly>
+template<GenType type>
 inline Move *generateSliderAndJumpMoves(const Position &pos, Move *moves, Bitboard pieces,
                                         Bitboard occupied, Bitboard empty, Bitboard enemy, Bitboard checkMask,
                                         Bitboard pinHV, Bitboard pinDA) {
@@ -359,47 +414,152 @@ inline Move *generateSliderAndJumpMoves(const Position &pos, Move *moves, Bitboa
     Bitboard pinnedDA = pinDA & pieces;
     pieces &= ~(pinnedHV | pinnedDA);
 
-    moves = generateMovesFromPieces<capturesOnly, false, false>(pos, moves, pieces, checkMask, occupied, empty, enemy);
+    moves = generateMovesFromPieces<type, false, false>(pos, moves, pieces, checkMask, occupied, empty, enemy);
 
-    moves = generateMovesFromPieces<capturesOnly, true, false>(pos, moves, pinnedHV, checkMask & pinHV, occupied, empty,
-                                                               enemy);
+    moves = generateMovesFromPieces<type, true, false>(pos, moves, pinnedHV, checkMask & pinHV, occupied, empty, enemy);
 
-    moves = generateMovesFromPieces<capturesOnly, false, true>(pos, moves, pinnedDA, checkMask & pinDA, occupied, empty,
-                                                               enemy);
+    moves = generateMovesFromPieces<type, false, true>(pos, moves, pinnedDA, checkMask & pinDA, occupied, empty, enemy);
 
     return moves;
 }
 
-// Generates all the legal moves in a position.
-template<Color color, bool capturesOnly>
-Move *generateMoves(const Position &pos, Move *moves) {
+// Generates the legal quiet moves which give check, except promotions and castling.
+// 'king' - the square where the friendly king is
+// 'checkMask' - a bitboard indicating to squares which evade check
+// 'safeSquares' - a bitboard of the squares not attacked by the enemy
+// 'pinHV', 'pinDA' - the pin masks of the friendly pieces
+// 'moveH' - a bitboard indicating pawns which can be pushed
+template<Color color>
+Move *generateQuietChecks(const Position &pos, Move *moves, Square king, Bitboard checkMask, Bitboard safeSquares,
+                          Bitboard pinHV, Bitboard pinDA, Bitboard moveH) {
+
     // Define enemy color
     constexpr Color enemyColor = EnemyColor<color>();
 
+    // Define move directions and ranks for double pawn push and promotion
+    constexpr Direction UP = color == WHITE ? NORTH : -NORTH;
+    constexpr Direction DOWN = -UP;
+    constexpr Bitboard doublePushRank = (color == WHITE ? rank3 : rank6);
+    constexpr Bitboard beforePromoRank = (color == WHITE ? rank7 : rank2);
+
+    Square enemyKing = pos.pieces<enemyColor, KING>().lsb();
+    Bitboard friendlyPieces = pos.friendly<color>();
+    Bitboard occupied = pos.occupied();
+    Bitboard empty = pos.empty();
+    Bitboard enemy = pos.enemy<color>();
+
+    // Find the friendly pieces standing between a friendly slider and the enemy king, these give a
+    // discovered check if they leave the common ray of the two
+    Bitboard seenSquares = pieceAttacks<QUEEN>(enemyKing, occupied);
+    Bitboard blockers = seenSquares & friendlyPieces;
+
+    occupied ^= blockers;
+    Bitboard sliders = ((pieceAttacks<ROOK>(enemyKing, occupied) & (pos.pieces<color, ROOK>() | pos.pieces<color, QUEEN>())) |
+                        (pieceAttacks<BISHOP>(enemyKing, occupied) & (pos.pieces<color, BISHOP>() | pos.pieces<color, QUEEN>()))) &
+                       ~seenSquares;
+    occupied ^= blockers;
+
+    Bitboard discoverers;
+    Bitboard discoveryRay[64];
+    while (sliders) {
+        Square slider = sliders.popLsb();
+        Bitboard blocker = commonRay[enemyKing][slider] & blockers;
+        discoverers |= blocker;
+        discoveryRay[blocker.lsb()] = commonRay[enemyKing][slider];
+    }
+
+    // Squares where a piece would give a direct check
+    Bitboard pawnChecks = pawnMasks[enemyKing][enemyColor];
+    Bitboard knightChecks = pieceAttacks<KNIGHT>(enemyKing, occupied);
+    Bitboard bishopChecks = pieceAttacks<BISHOP>(enemyKing, occupied);
+    Bitboard rookChecks = pieceAttacks<ROOK>(enemyKing, occupied);
+
+    // Generate pawn pushes, promotions are left to the other generators
+    Bitboard pawns = pos.pieces<color, PAWN>() & ~beforePromoRank & moveH;
+    Bitboard singlePush = step<UP>(pawns) & empty;
+    Bitboard doublePush = step<UP>(singlePush & doublePushRank) & empty & checkMask;
+    singlePush &= checkMask;
+
+    while (singlePush) {
+        Square to = singlePush.popLsb();
+        Square from = to + DOWN;
+        if (pawnChecks.get(to) || (discoverers.get(from) && !discoveryRay[from].get(to)))
+            *moves++ = Move(from, to);
+    }
+
+    while (doublePush) {
+        Square to = doublePush.popLsb();
+        Square from = to + 2 * DOWN;
+        if (pawnChecks.get(to) || (discoverers.get(from) && !discoveryRay[from].get(to)))
+            *moves++ = Move(from, to, DOUBLE_PAWN_PUSH);
+    }
+
+    // Generate the direct checks of the knights and the sliders
+    Bitboard pieces = friendlyPieces & ~(pos.pieces<PAWN>() | pos.pieces<KING>() | discoverers);
+
+    moves = generateSliderAndJumpMoves<GEN_QUIETS>(pos, moves, pieces & pos.pieces<KNIGHT>(), occupied, empty, enemy,
+                                                   checkMask & knightChecks, pinHV, pinDA);
+    moves = generateSliderAndJumpMoves<GEN_QUIETS>(pos, moves, pieces & pos.pieces<BISHOP>(), occupied, empty, enemy,
+                                                   checkMask & bishopChecks, pinHV, pinDA);
+    moves = generateSliderAndJumpMoves<GEN_QUIETS>(pos, moves, pieces & pos.pieces<ROOK>(), occupied, empty, enemy,
+                                                   checkMask & rookChecks, pinHV, pinDA);
+    moves = generateSliderAndJumpMoves<GEN_QUIETS>(pos, moves, pieces & pos.pieces<QUEEN>(), occupied, empty, enemy,
+                                                   checkMask & (bishopChecks | rookChecks), pinHV, pinDA);
+
+    // Generate the discovered checks, every move leaving the ray gives check
+    Bitboard discoveringPieces = discoverers & ~pos.pieces<PAWN>();
+    while (discoveringPieces) {
+        Square from = discoveringPieces.popLsb();
+        if (from == king) {
+            moves = generateKingMoves<GEN_QUIETS>(pos, moves, king, safeSquares & ~discoveryRay[king], empty, enemy);
+        } else {
+            moves = generateSliderAndJumpMoves<GEN_QUIETS>(pos, moves, from, occupied, empty, enemy,
+                                                           checkMask & ~discoveryRay[from], pinHV, pinDA);
+        }
+    }
+
+    return moves;
+}
+
+// Masks of the squares and the pieces which restrict the legal moves of a color, shared by the move generator
+// and the move counter.
+struct LegalMasks {
+    Square king;          // The square where the friendly king is
+    Bitboard safeSquares; // The squares not attacked by the enemy, when the king isn't blocking a slider
+    Bitboard checkMask;   // The "to" squares which evade check, empty in a double check
+    Bitboard pinHV, pinDA;                // The rays of the horizontal/vertical and the diagonal pins
+    Bitboard moveH, moveV, moveD, moveA; // The pieces which can move in a direction without breaking a pin
+};
+
+// Calculates the masks restricting the legal moves of 'color'. In a double check the pins aren't calculated,
+// as only the king can move.
+template<Color color>
+inline LegalMasks getLegalMasks(const Position &pos) {
+    // Define enemy color
+    constexpr Color enemyColor = EnemyColor<color>();
+
+    LegalMasks masks;
+
     // Define friendly king square
-    Square king = pos.pieces<color, KING>().lsb();
+    Square king = masks.king = pos.pieces<color, KING>().lsb();
     assert(king != NULL_SQUARE);
 
-    // Define bitboards used for move generation
+    // Define bitboards used for calculating the masks
     Bitboard friendlyPieces = pos.friendly<color>();
-    Bitboard empty = pos.empty();
     Bitboard enemy = pos.enemy<color>();
     Bitboard occupied = pos.occupied();
     Bitboard checkers = getAttackers<color>(pos, king);
 
     occupied.clear(king);
-    Bitboard safeSquares = ~getAttackedSquares<enemyColor>(pos, occupied);
+    masks.safeSquares = ~getAttackedSquares<enemyColor>(pos, occupied);
     occupied.set(king);
 
     // Generate checkMask
-    Bitboard checkMask = generateCheckMask(pos, king, checkers);
-
-    // Generate king moves
-    moves = generateKingMoves<capturesOnly>(pos, moves, king, safeSquares, empty, enemy);
+    masks.checkMask = generateCheckMask(pos, king, checkers);
 
     // If we are in a double check, only king moves are legal
-    if (checkMask == 0)
-        return moves;
+    if (masks.checkMask == 0)
+        return masks;
 
     // Generate pinMasks
     Bitboard seenSquares = pieceAttacks<QUEEN>(king, occupied);
@@ -415,13 +575,12 @@ Move *generateMoves(const Position &pos, Move *moves) {
                        possiblePinners;
 
     // Define bitboards used for storing pin information
-    Bitboard pinH, pinV, pinD, pinA, pinHV, pinDA, moveH, moveV, moveD, moveA;
+    Bitboard pinH, pinV, pinD, pinA;
 
     // Calculate pins
     while (pinners) {
         Square pinner = pinners.popLsb();
-        LineType type = lineType[king][pinner];
-        switch (type) {
+        switch (lineType[king][pinner]) {
             case HORIZONTAL:
                 pinH |= commonRay[king][pinner] | pinner;
                 break;
@@ -437,78 +596,364 @@ Move *generateMoves(const Position &pos, Move *moves) {
         }
     }
 
-    pinHV = pinH | pinV;
-    pinDA = pinD | pinA;
+    masks.pinHV = pinH | pinV;
+    masks.pinDA = pinD | pinA;
 
     pinH &= friendlyPieces;
     pinV &= friendlyPieces;
     pinD &= friendlyPieces;
     pinA &= friendlyPieces;
 
-    moveH = ~(pinV | pinD | pinA);
-    moveV = ~(pinH | pinD | pinA);
-    moveD = ~(pinH | pinV | pinA);
-    moveA = ~(pinH | pinV | pinD);
+    masks.moveH = ~(pinV | pinD | pinA);
+    masks.moveV = ~(pinH | pinD | pinA);
+    masks.moveD = ~(pinH | pinV | pinA);
+    masks.moveA = ~(pinH | pinV | pinD);
 
-    occupied ^= possiblePins;
+    return masks;
+}
+
+// Generates the legal castling moves.
+template<Color color>
+inline Move *generateCastlingMoves(const Position &pos, Move *moves, Bitboard safeSquares, Bitboard empty) {
+    if constexpr (color == WHITE) {
+        if (pos.getCastleRight(WK_MASK) &&
+            (safeSquares & WK_CASTLE_SAFE) == WK_CASTLE_SAFE && (empty & WK_CASTLE_EMPTY) == WK_CASTLE_EMPTY) {
+
+            *moves++ = Move(E1, G1, KING_CASTLE);
+        }
+
+        if (pos.getCastleRight(WQ_MASK) &&
+            (safeSquares & WQ_CASTLE_SAFE) == WQ_CASTLE_SAFE && (empty & WQ_CASTLE_EMPTY) == WQ_CASTLE_EMPTY) {
+
+            *moves++ = Move(E1, C1, QUEEN_CASTLE);
+        }
+    } else {
+        if (pos.getCastleRight(BK_MASK) &&
+            (safeSquares & BK_CASTLE_SAFE) == BK_CASTLE_SAFE && (empty & BK_CASTLE_EMPTY) == BK_CASTLE_EMPTY) {
+
+            *moves++ = Move(E8, G8, KING_CASTLE);
+        }
+
+        if (pos.getCastleRight(BQ_MASK) &&
+            (safeSquares & BQ_CASTLE_SAFE) == BQ_CASTLE_SAFE && (empty & BQ_CASTLE_EMPTY) == BQ_CASTLE_EMPTY) {
+
+            *moves++ = Move(E8, C8, QUEEN_CASTLE);
+        }
+    }
+
+    return moves;
+}
+
+// Generates all the legal moves of a kind in a position.
+template<Color color, GenType type>
+Move *generateMoves(const Position &pos, Move *moves) {
+
+    LegalMasks masks = getLegalMasks<color>(pos);
+
+    // Define bitboards used for move generation
+    Bitboard friendlyPieces = pos.friendly<color>();
+    Bitboard empty = pos.empty();
+    Bitboard enemy = pos.enemy<color>();
+    Bitboard occupied = pos.occupied();
+
+    // Generate king moves, when generating quiet checks the king can only give a discovered check
+    if constexpr (type != GEN_QUIET_CHECKS)
+        moves = generateKingMoves<type>(pos, moves, masks.king, masks.safeSquares, empty, enemy);
+
+    // If we are in a double check, only king moves are legal
+    if (masks.checkMask == 0)
+        return moves;
+
+    // Generate quiet checks
+    if constexpr (type == GEN_QUIET_CHECKS)
+        return generateQuietChecks<color>(pos, moves, masks.king, masks.checkMask, masks.safeSquares, masks.pinHV,
+                                          masks.pinDA, masks.moveH);
 
     // Generate pawn moves
-    moves = generatePawnMoves<color, capturesOnly>(pos, moves, king, checkMask, moveH, moveV, moveD, moveA);
+    moves = generatePawnMoves<color, type>(pos, moves, masks.king, masks.checkMask, masks.moveH, masks.moveV,
+                                           masks.moveD, masks.moveA);
 
     // Generate knight and slider moves
     Bitboard sliderAndJumperPieces = friendlyPieces & ~pos.pieces<PAWN>();
-    sliderAndJumperPieces.clear(king);
+    sliderAndJumperPieces.clear(masks.king);
 
-    moves = generateSliderAndJumpMoves<capturesOnly>(pos, moves, sliderAndJumperPieces, occupied, empty, enemy,
-                                                     checkMask, pinHV, pinDA);
+    moves = generateSliderAndJumpMoves<type>(pos, moves, sliderAndJumperPieces, occupied, empty, enemy,
+                                             masks.checkMask, masks.pinHV, masks.pinDA);
 
     // Generate castling moves
-    if constexpr (!capturesOnly) {
-        if constexpr (color == WHITE) {
-            if (pos.getCastleRight(WK_MASK) &&
-                (safeSquares & WK_CASTLE_SAFE) == WK_CASTLE_SAFE && (empty & WK_CASTLE_EMPTY) == WK_CASTLE_EMPTY) {
+    if constexpr (type == GEN_ALL || type == GEN_QUIETS)
+        moves = generateCastlingMoves<color>(pos, moves, masks.safeSquares, empty);
 
-                *moves++ = Move(E1, G1, KING_CASTLE);
-            }
+    return moves;
+}
 
-            if (pos.getCastleRight(WQ_MASK) &&
-                (safeSquares & WQ_CASTLE_SAFE) == WQ_CASTLE_SAFE && (empty & WQ_CASTLE_EMPTY) == WQ_CASTLE_EMPTY) {
+/*
+ * Counts the legal moves without writing them, by the popcount of the target squares of every piece.
+ * If 'anyMove' is set, the counting stops as soon as a legal move is found.
+ */
+template<Color color, bool anyMove>
+unsigned int countMoves(const Position &pos) {
 
-                *moves++ = Move(E1, C1, QUEEN_CASTLE);
-            }
+    // Define move directions
+    constexpr Direction UP = color == WHITE ? NORTH : -NORTH;
+    constexpr Direction UP_LEFT = color == WHITE ? NORTH_WEST : -NORTH_WEST;
+    constexpr Direction UP_RIGHT = color == WHITE ? NORTH_EAST : -NORTH_EAST;
+
+    // Define ranks for double pawn push and promotion
+    constexpr Bitboard doublePushRank = (color == WHITE ? rank3 : rank6);
+    constexpr Bitboard beforePromoRank = (color == WHITE ? rank7 : rank2);
+
+    LegalMasks masks = getLegalMasks<color>(pos);
+
+    Bitboard friendlyPieces = pos.friendly<color>();
+    Bitboard empty = pos.empty();
+    Bitboard enemy = pos.enemy<color>();
+    Bitboard occupied = pos.occupied();
+    Bitboard checkMask = masks.checkMask;
+
+    // Count the king moves
+    unsigned int count = (kingMasks[masks.king] & masks.safeSquares & ~friendlyPieces).popCount();
+
+    if ((anyMove && count) || checkMask == 0)
+        return count;
+
+    // Count the pawn moves, every promotion counts as 4 moves
+    Bitboard pawns = pos.pieces<color, PAWN>() & ~beforePromoRank;
+    Bitboard pawnsBeforePromo = pos.pieces<color, PAWN>() & beforePromoRank;
+
+    Bitboard singlePush = step<UP>(pawns & masks.moveH) & empty;
+    Bitboard doublePush = step<UP>(singlePush & doublePushRank) & empty;
+
+    count += (singlePush & checkMask).popCount() + (doublePush & checkMask).popCount() +
+             (step<UP_RIGHT>(pawns & masks.moveD) & enemy & checkMask).popCount() +
+             (step<UP_LEFT>(pawns & masks.moveA) & enemy & checkMask).popCount();
+
+    if (pawnsBeforePromo) {
+        count += 4 * ((step<UP>(pawnsBeforePromo & masks.moveH) & empty & checkMask).popCount() +
+                      (step<UP_RIGHT>(pawnsBeforePromo & masks.moveD) & enemy & checkMask).popCount() +
+                      (step<UP_LEFT>(pawnsBeforePromo & masks.moveA) & enemy & checkMask).popCount());
+    }
+
+    // En passant needs the discovered attack checks of the generator, but there are at most 2 of them
+    Move epMoves[2];
+    count += generateEpMoves<color>(pos, epMoves, masks.king, checkMask, masks.moveD, masks.moveA) - epMoves;
+
+    if (anyMove && count)
+        return count;
+
+    // Count the knight and slider moves, pinned pieces can only move on the ray of the pin
+    Bitboard pieces = friendlyPieces & ~pos.pieces<PAWN>();
+    pieces.clear(masks.king);
+
+    while (pieces) {
+        Square from = pieces.popLsb();
+        Bitboard targets = pieceAttacks(pos.pieceAt(from).type, from, occupied) & ~friendlyPieces & checkMask;
+
+        if (masks.pinHV.get(from))
+            targets &= masks.pinHV & rookMasks[from];
+        else if (masks.pinDA.get(from))
+            targets &= masks.pinDA & bishopMasks[from];
+
+        count += targets.popCount();
+
+        if (anyMove && count)
+            return count;
+    }
+
+    // Count the castling moves
+    Move castlingMoves[2];
+    count += generateCastlingMoves<color>(pos, castlingMoves, masks.safeSquares, empty) - castlingMoves;
+
+    return count;
+}
+
+// Returns true if a square is attacked by the enemy of 'color', including the attacks of the enemy king.
+template<Color color>
+inline bool isAttacked(const Position &pos, Square square, Bitboard occupied) {
+    return getAttackers<color>(pos, square, occupied) || (kingMasks[square] & pos.pieces<EnemyColor<color>(), KING>());
+}
+
+// Returns true if a move, which wasn't generated in the position, could be made by the side to move.
+// Checks the piece, the flags and the path of the move, but not whether it leaves the king in check.
+template<Color color>
+bool isPseudoLegal(const Position &pos, Move move) {
+
+    constexpr Direction UP = color == WHITE ? NORTH : -NORTH;
+    constexpr Bitboard promoRank = color == WHITE ? rank8 : rank1;
+    constexpr Bitboard doublePushRank = color == WHITE ? rank4 : rank5;
+    constexpr Square kingStart = color == WHITE ? E1 : E8;
+
+    Square from = move.getFrom();
+    Square to = move.getTo();
+    Piece piece = pos.pieceAt(from);
+
+    if (!move.isOk() || piece.color != color || pos.friendly<color>().get(to))
+        return false;
+
+    Bitboard occupied = pos.occupied();
+
+    if (move.equalFlag(EP_CAPTURE))
+        return piece.type == PAWN && to == pos.getEpSquare() && pawnMasks[from][color].get(to);
+
+    // The capture flag has to match the target square
+    if (move.isCapture() != pos.enemy<color>().get(to))
+        return false;
+
+    if (piece.type == PAWN) {
+        if (move.isPromo() != promoRank.get(to))
+            return false;
+
+        if (move.isCapture())
+            return (move.isPromo() || move.equalFlag(CAPTURE)) && pawnMasks[from][color].get(to);
+
+        Square singlePush = from + UP;
+        if (move.equalFlag(DOUBLE_PAWN_PUSH))
+            return doublePushRank.get(to) && to == singlePush + UP && !occupied.get(singlePush);
+
+        return (move.isPromo() || move.equalFlag(QUIET_MOVE)) && to == singlePush;
+    }
+
+    // The safety of the castling squares is left to isLegal
+    if (move.equalFlag(KING_CASTLE) || move.equalFlag(QUEEN_CASTLE)) {
+        if (piece.type != KING || from != kingStart)
+            return false;
+
+        Bitboard empty = pos.empty();
+        if constexpr (color == WHITE) {
+            return move.equalFlag(KING_CASTLE) ? to == G1 && pos.getCastleRight(WK_MASK) && (empty & WK_CASTLE_EMPTY) == WK_CASTLE_EMPTY
+                                               : to == C1 && pos.getCastleRight(WQ_MASK) && (empty & WQ_CASTLE_EMPTY) == WQ_CASTLE_EMPTY;
         } else {
-            if (pos.getCastleRight(BK_MASK) &&
-                (safeSquares & BK_CASTLE_SAFE) == BK_CASTLE_SAFE && (empty & BK_CASTLE_EMPTY) == BK_CASTLE_EMPTY) {
+            return move.equalFlag(KING_CASTLE) ? to == G8 && pos.getCastleRight(BK_MASK) && (empty & BK_CASTLE_EMPTY) == BK_CASTLE_EMPTY
+                                               : to == C8 && pos.getCastleRight(BQ_MASK) && (empty & BQ_CASTLE_EMPTY) == BQ_CASTLE_EMPTY;
+        }
+    }
 
-                *moves++ = Move(E8, G8, KING_CASTLE);
-            }
+    if (!move.equalFlag(QUIET_MOVE) && !move.equalFlag(CAPTURE))
+        return false;
+
+    return pieceAttacks(piece.type, from, occupied).get(to);
+}
+
+// Returns true if a pseudo-legal move doesn't leave the king in check. Uses the check and pin masks of the
+// move generator, so the move doesn't have to be made.
+template<Color color>
+bool isLegal(const Position &pos, Move move) {
 
-            if (pos.getCastleRight(BQ_MASK) &&
-                (safeSquares & BQ_CASTLE_SAFE) == BQ_CASTLE_SAFE && (empty & BQ_CASTLE_EMPTY) == BQ_CASTLE_EMPTY) {
+    constexpr Color enemyColor = EnemyColor<color>();
+    constexpr Direction DOWN = color == WHITE ? -NORTH : NORTH;
 
-                *moves++ = Move(E8, C8, QUEEN_CASTLE);
+    Square king = pos.pieces<color, KING>().lsb();
+    Square from = move.getFrom();
+    Square to = move.getTo();
+    Bitboard occupied = pos.occupied();
+
+    if (from == king) {
+        // The king and the squares it passes through can't be attacked while castling
+        if (move.equalFlag(KING_CASTLE) || move.equalFlag(QUEEN_CASTLE)) {
+            Bitboard safeMask;
+            if constexpr (color == WHITE) {
+                safeMask = move.equalFlag(KING_CASTLE) ? WK_CASTLE_SAFE : WQ_CASTLE_SAFE;
+            } else {
+                safeMask = move.equalFlag(KING_CASTLE) ? BK_CASTLE_SAFE : BQ_CASTLE_SAFE;
+            }
+
+            while (safeMask) {
+                if (isAttacked<color>(pos, safeMask.popLsb(), occupied))
+                    return false;
             }
+            return true;
         }
+
+        // The king is removed, so it can't hide behind itself from a slider
+        occupied.clear(king);
+        return !isAttacked<color>(pos, to, occupied);
     }
 
-    return moves;
+    // An en passant capture removes two pieces from the king's lines, so the position after the move is checked
+    if (move.equalFlag(EP_CAPTURE)) {
+        occupied.clear(from);
+        occupied.clear(to + DOWN);
+        occupied.set(to);
+        return !getAttackers<color>(pos, king, occupied);
+    }
+
+    // Every other move has to evade the checks
+    if (!generateCheckMask(pos, king, getAttackers<color>(pos, king)).get(to))
+        return false;
+
+    // A pinned piece can only move on the line between the king and the pinner
+    occupied.clear(from);
+    Bitboard pinners = (pieceAttacks<ROOK>(king, occupied) & (pos.pieces<enemyColor, ROOK>() | pos.pieces<enemyColor, QUEEN>())) |
+                       (pieceAttacks<BISHOP>(king, occupied) & (pos.pieces<enemyColor, BISHOP>() | pos.pieces<enemyColor, QUEEN>()));
+
+    while (pinners) {
+        Square pinner = pinners.popLsb();
+        if (commonRay[king][pinner].get(from) && to != pinner && !commonRay[king][pinner].get(to))
+            return false;
+    }
+
+    return true;
+}
+
+bool Position::isPseudoLegal(Move move) const {
+    if (getSideToMove() == WHITE) {
+        return ::isPseudoLegal<WHITE>(*this, move);
+    } else {
+        return ::isPseudoLegal<BLACK>(*this, move);
+    }
+}
+
+bool Position::isLegal(Move move) const {
+    if (getSideToMove() == WHITE) {
+        return ::isLegal<WHITE>(*this, move);
+    } else {
+        return ::isLegal<BLACK>(*this, move);
+    }
 }
 
 // Wrapper around the stm template.
-template<bool capturesOnly>
+template<GenType type>
 Move *generateMoves(const Position &pos, Move *moves) {
     if (pos.getSideToMove() == WHITE) {
-        return generateMoves<WHITE, capturesOnly>(pos, moves);
+        return generateMoves<WHITE, type>(pos, moves);
     } else {
-        return generateMoves<BLACK, capturesOnly>(pos, moves);
+        return generateMoves<BLACK, type>(pos, moves);
     }
 }
 
-// Wrapper around captures only template.
-Move *generateMoves(const Position &pos, Move *moves, bool capturesOnly) {
-    if (capturesOnly) {
-        return generateMoves<true>(pos, moves);
+// Wrapper around the move kind template.
+Move *generateMoves(const Position &pos, Move *moves, GenType type) {
+    switch (type) {
+        case GEN_CAPTURES:
+            return generateMoves<GEN_CAPTURES>(pos, moves);
+        case GEN_QUIETS:
+            return generateMoves<GEN_QUIETS>(pos, moves);
+        case GEN_EVASIONS:
+            return generateMoves<GEN_EVASIONS>(pos, moves);
+        case GEN_QUIET_CHECKS:
+            return generateMoves<GEN_QUIET_CHECKS>(pos, moves);
+        default:
+            return generateMoves<GEN_ALL>(pos, moves);
+    }
+}
+
+unsigned int countLegalMoves(const Position &pos) {
+    if (pos.getSideToMove() == WHITE) {
+        return countMoves<WHITE, false>(pos);
     } else {
-        return generateMoves<false>(pos, moves);
+        return countMoves<BLACK, false>(pos);
     }
-}
\ No newline at end of file
+}
+
+bool hasLegalMove(const Position &pos) {
+    if (pos.getSideToMove() == WHITE) {
+        return countMoves<WHITE, true>(pos) != 0;
+    } else {
+        return countMoves<BLACK, true>(pos) != 0;
+    }
+}
+
+// Wrapper around captures only template.
+Move *generateMoves(const Position &pos, Move *moves, bool capturesOnly) {
+    return generateMoves(pos, moves, capturesOnly ? GEN_CAPTURES : GEN_ALL);
+}
@@ -20,17 +20,27 @@
 #include "position.h"
 #include "threads.h"
 
-// Returns a bitboard of all the squares attacking a given square for the given color
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+
+// Returns a bitboard of all the squares attacking a given square for the given color, when only the
+// pieces on 'occupied' are on the board
 template<Color color>
-inline Bitboard getAttackers(const Position &pos, Square square) {
-    Bitboard occupied = pos.occupied();
+inline Bitboard getAttackers(const Position &pos, Square square, Bitboard occupied) {
     Bitboard enemy = pos.enemy<color>();
     return ((pawnMasks[square][color] & pos.pieces<PAWN>()) |
             (pieceAttacks<KNIGHT>(square, occupied) & pos.pieces<KNIGHT>()) |
             (pieceAttacks<BISHOP>(square, occupied) & pos.pieces<BISHOP>()) |
             (pieceAttacks<ROOK>(square, occupied) & pos.pieces<ROOK>()) |
             (pieceAttacks<QUEEN>(square, occupied) & pos.pieces<QUEEN>())) &
-           enemy;
+           enemy & occupied;
+}
+
+// Returns a bitboard of all the squares attacking a given square for the given color
+template<Color color>
+inline Bitboard getAttackers(const Position &pos, Square square) {
+    return getAttackers<color>(pos, square, pos.occupied());
 }
 
 // Returns a bitboard of all the squares attacking a given square for the side to move
@@ -41,28 +51,161 @@ inline Bitboard getAttackers(const Position &pos, Square square) {
         return getAttackers<BLACK>(pos, square);
 }
 
+// Kinds of moves which can be generated
+enum GenType {
+    GEN_ALL,
+    GEN_CAPTURES,
+    GEN_QUIETS,
+    GEN_EVASIONS,    // Every legal move while in check, without trying castling
+    GEN_QUIET_CHECKS // Non-promotion quiet moves which give a direct or a discovered check
+};
+
+Move *generateMoves(const Position &pos, Move *moves, GenType type);
+
 Move *generateMoves(const Position &pos, Move *moves, bool capturesOnly);
 
-// Stores and orders legal moves in a position.
-template<bool capturesOnly, bool rootNode>
-struct MoveList {
-    Move moves[200];
-    Move *movesEnd;
-    unsigned int index;
+// Returns the number of legal moves in the position without generating them.
+unsigned int countLegalMoves(const Position &pos);
 
-    Score scores[200];
+// Returns true if the side to move has a legal move.
+bool hasLegalMove(const Position &pos);
 
+// A move and its score packed into a single integer, so the best move of a list is found by comparing the keys only.
+// Moves with equal scores are ordered by their encoding.
+struct ScoredMove {
+    int64_t key;
+
+    ScoredMove() = default;
+
+    constexpr ScoredMove(Move move, Score score) : key(int64_t(score) * 65536 + move.getData()) {}
+
+    constexpr Move move() const {
+        return Move(uint16_t(key & 0xFFFF));
+    }
+
+    constexpr Score score() const {
+        return Score(key >> 16);
+    }
+};
+
+// Lists of scored moves are followed by this many sentinels, so the vectorized selection can read past their end.
+constexpr unsigned int SCORED_MOVE_PADDING = 8;
+constexpr int64_t SCORED_MOVE_SENTINEL = INT64_MIN;
+
+// Quiet moves scored above -QUIET_SORT_MARGIN * depth are sorted before the quiet stage, the rest are tried unsorted.
+constexpr Score QUIET_SORT_MARGIN = 3000;
+
+// Writes the sentinels after the end of a list of scored moves.
+inline void padScoredMoves(ScoredMove *end) {
+    for (unsigned int i = 0; i < SCORED_MOVE_PADDING; i++) {
+        end[i].key = SCORED_MOVE_SENTINEL;
+    }
+}
+
+// Lists shorter than this are searched for their best move without vectorization.
+constexpr unsigned int VECTOR_SELECT_THRESHOLD = 16;
+
+// Selects the vectorized best move selection in the dispatch build.
+void initMoveSelection();
+
+// Returns the name of the method used for selecting the best move of a list.
+const char *getMoveSelectionName();
+
+#if defined(DISPATCH)
+// True if AVX2 was found to be supported by the CPU in initMoveSelection().
+extern bool useVectorSelect;
+#endif
+
+#if defined(AVX2) || defined(DISPATCH)
+// Returns the index of the highest scored move between 'begin' and 'end' with AVX2. The list has to be padded.
+inline __attribute__((target("avx2"))) unsigned int selectBestAVX2(const ScoredMove *moves, unsigned int begin,
+                                                                   unsigned int end) {
+    // The keys are unique, so the first key equal to the maximum belongs to the best move.
+    __m256i best = _mm256_loadu_si256((const __m256i *) (moves + begin));
+    for (unsigned int i = begin + 4; i < end; i += 4) {
+        __m256i keys = _mm256_loadu_si256((const __m256i *) (moves + i));
+        best = _mm256_blendv_epi8(best, keys, _mm256_cmpgt_epi64(keys, best));
+    }
+    alignas(32) int64_t lanes[4];
+    _mm256_store_si256((__m256i *) lanes, best);
+    __m256i bestKey = _mm256_set1_epi64x(std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3])));
+    for (unsigned int i = begin;; i += 4) {
+        __m256i keys = _mm256_loadu_si256((const __m256i *) (moves + i));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(bestKey, keys)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+}
+#endif
+
+// Returns the index of the highest scored move between 'begin' and 'end'. The list has to be padded.
+// The dispatch build selects the AVX2 variant at startup, AVX-512 is only used when it is compiled for.
+inline unsigned int selectBest(const ScoredMove *moves, unsigned int begin, unsigned int end) {
+#if defined(AVX512)
+    if (end - begin >= VECTOR_SELECT_THRESHOLD) {
+        // The keys are unique, so the first key equal to the maximum belongs to the best move.
+        __m512i best = _mm512_loadu_si512(moves + begin);
+        for (unsigned int i = begin + 8; i < end; i += 8) {
+            best = _mm512_max_epi64(best, _mm512_loadu_si512(moves + i));
+        }
+        __m512i bestKey = _mm512_set1_epi64(_mm512_reduce_max_epi64(best));
+        for (unsigned int i = begin;; i += 8) {
+            __mmask8 mask = _mm512_cmpeq_epi64_mask(bestKey, _mm512_loadu_si512(moves + i));
+            if (mask)
+                return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(AVX2)
+    if (end - begin >= VECTOR_SELECT_THRESHOLD)
+        return selectBestAVX2(moves, begin, end);
+#elif defined(DISPATCH)
+    if (useVectorSelect && end - begin >= VECTOR_SELECT_THRESHOLD)
+        return selectBestAVX2(moves, begin, end);
+#endif
+
+    unsigned int bestIndex = begin;
+    for (unsigned int i = begin + 1; i < end; i++) {
+        if (moves[i].key > moves[bestIndex].key) {
+            bestIndex = i;
+        }
+    }
+    return bestIndex;
+}
+
+// Sorts the moves scored at least 'limit' to the front of the list in descending order, the order of the rest
+// is unspecified.
+inline void partialInsertionSort(ScoredMove *begin, ScoredMove *end, Score limit) {
+    int64_t limitKey = int64_t(limit) * 65536;
+    for (ScoredMove *sortedEnd = begin, *p = begin + 1; p < end; p++) {
+        if (p->key >= limitKey) {
+            ScoredMove move = *p;
+            *p = *++sortedEnd;
+            ScoredMove *q = sortedEnd;
+            for (; q != begin && (q - 1)->key < move.key; q--) {
+                *q = *(q - 1);
+            }
+            *q = move;
+        }
+    }
+}
+
+// Stores the legal moves of the root, ordered by the nodes searched after them. Every other node uses the
+// MovePicker.
+struct RootMoveList {
+    alignas(64) ScoredMove moves[200 + SCORED_MOVE_PADDING];
+    unsigned int index;
     unsigned int count;
 
     // Constructor that generates and scores legal moves.
-    MoveList(const Position &pos, ThreadData &td, Move prevMove, Ply ply) {
-        movesEnd = generateMoves(pos, moves, capturesOnly);
+    RootMoveList(const Position &pos, ThreadData &td) {
+        Move generated[200];
+        count = generateMoves(pos, generated, GEN_ALL) - generated;
         index = 0;
-        count = movesEnd - moves;
 
         for (unsigned int i = 0; i < count; i++) {
-            scores[i] = rootNode ? td.scoreRootNode(moves[i]) : td.scoreMove(pos, prevMove, moves[i], ply);
+            moves[i] = {generated[i], td.scoreRootNode(generated[i])};
         }
+        padScoredMoves(moves + count);
     }
 
     // Returns true if there are no more moves left.
@@ -70,17 +213,251 @@ struct MoveList {
         return index == count;
     }
 
-    // Sorts and returns the next best scored move.
+    // Sorts and returns the next best scored move, or MOVE_NULL if there are no more moves left.
     inline Move nextMove() {
-        unsigned int best = index;
-        for (unsigned int i = index; i < count; i++) {
-            if (scores[i] > scores[best]) {
-                best = i;
-            }
+        if (index == count)
+            return MOVE_NULL;
+
+        std::swap(moves[index], moves[selectBest(moves, index, count)]);
+        return moves[index++].move();
+    }
+};
+
+// Stages of the move picker
+enum PickerStage {
+    STAGE_TT_MOVE,
+    STAGE_GEN_CAPTURES,
+    STAGE_GOOD_CAPTURES,
+    STAGE_KILLER_1,
+    STAGE_KILLER_2,
+    STAGE_COUNTER_MOVE,
+    STAGE_GEN_QUIETS,
+    STAGE_QUIETS,
+    STAGE_BAD_CAPTURES,
+    STAGE_QS_TT_MOVE,
+    STAGE_QS_GEN_CAPTURES,
+    STAGE_QS_CAPTURES,
+    STAGE_QS_GEN_CHECKS,
+    STAGE_QS_CHECKS,
+    STAGE_QS_GEN_EVASIONS,
+    STAGE_QS_EVASIONS,
+    STAGE_DONE
+};
+
+/*
+ * Staged move picker
+ *
+ * Returns the legal moves of a position one by one, only generating and scoring a kind of moves once it's reached:
+ * the TT move, the captures which don't lose material, the killers and the counter move, the quiet moves and
+ * finally the losing captures. The TT move and the refutations are validated without generating anything, so
+ * a cutoff by them saves the whole move generation. The moves are stored with their scores packed into one key,
+ * the best one is selected by the keys, except for the quiet moves which are partially sorted once.
+ *
+ * In quiescence search the TT move and every evasion are returned when in check. Otherwise the TT move, if it's a
+ * capture, the captures and optionally the quiet checks.
+ */
+struct MovePicker {
+    Position &pos;
+    ThreadData &td;
+    PickerStage stage = STAGE_TT_MOVE;
+
+    Move ttMove, killers[2], counterMove;
+    bool inCheck = false, quietChecks = false;
+
+    Depth depth = 0;
+    const SearchStack *stack = nullptr;
+
+    alignas(64) ScoredMove moves[200 + SCORED_MOVE_PADDING];
+    unsigned int index = 0, count = 0;
+
+    alignas(64) ScoredMove badCaptures[200 + SCORED_MOVE_PADDING];
+    unsigned int badIndex = 0, badCount = 0;
+
+    MovePicker(Position &pos, ThreadData &td, Move ttMove, const SearchStack *stack, Depth depth)
+        : pos(pos), td(td), ttMove(ttMove), depth(depth), stack(stack) {
+        Move prevMove = (stack - 1)->move;
+        killers[0] = td.killerMoves[stack->ply][0];
+        killers[1] = td.killerMoves[stack->ply][1];
+        counterMove = td.counterMoves[prevMove.getFrom()][prevMove.getTo()];
+    }
+
+    // Constructor used by the quiescence search.
+    MovePicker(Position &pos, ThreadData &td, Move ttMove, bool inCheck, bool quietChecks)
+        : pos(pos), td(td), stage(STAGE_QS_TT_MOVE), ttMove(ttMove), inCheck(inCheck), quietChecks(quietChecks) {}
+
+    // Returns true if a move, which wasn't generated, can be played in the position. Otherwise the move is cleared,
+    // so the later stages don't skip it.
+    inline bool isValid(Move &move) {
+        if (pos.isPseudoLegal(move) && pos.isLegal(move))
+            return true;
+        move = MOVE_NULL;
+        return false;
+    }
+
+    // Returns true if a move was already returned by an earlier stage, the moves which weren't are cleared.
+    inline bool isSpecial(Move move) const {
+        return move == ttMove || move == killers[0] || move == killers[1] || move == counterMove;
+    }
+
+    // Generates and scores the captures.
+    inline void generateCaptures() {
+        Move generated[200];
+        count = generateMoves(pos, generated, GEN_CAPTURES) - generated;
+        index = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            moves[i] = {generated[i], td.scoreCapture(pos, generated[i])};
         }
-        std::swap(moves[index], moves[best]);
-        std::swap(scores[index], scores[best]);
+        padScoredMoves(moves + count);
+    }
 
-        return moves[index++];
+    // Generates and scores the quiet moves, the evasions or the quiet checks. Captures are scored above the quiets,
+    // the continuation histories are only used outside the quiescence search.
+    inline void generateScored(GenType type) {
+        Move generated[200];
+        count = generateMoves(pos, generated, type) - generated;
+        index = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            Move move = generated[i];
+            moves[i] = {move, move.isCapture() ? 2000000 + td.scoreCapture(pos, move) : td.scoreQuiet(pos, move, stack)};
+        }
+        padScoredMoves(moves + count);
+    }
+
+    // Returns the next best scored move of the current list.
+    inline Move nextScored() {
+        std::swap(moves[index], moves[selectBest(moves, index, count)]);
+        return moves[index++].move();
+    }
+
+    // Returns the next move or MOVE_NULL if there are no more moves left.
+    Move nextMove() {
+        switch (stage) {
+            case STAGE_TT_MOVE:
+                stage = STAGE_GEN_CAPTURES;
+                if (isValid(ttMove))
+                    return ttMove;
+                [[fallthrough]];
+
+            case STAGE_GEN_CAPTURES:
+                generateCaptures();
+                stage = STAGE_GOOD_CAPTURES;
+                [[fallthrough]];
+
+            case STAGE_GOOD_CAPTURES:
+                while (index < count) {
+                    Move move = nextScored();
+                    if (move == ttMove)
+                        continue;
+
+                    // Losing captures and under promotions are deferred until the quiet moves are tried.
+                    if ((move.isPromo() && !(move.isSpecial1() && move.isSpecial2())) ||
+                        (!move.isPromo() && !see(pos, move, 0))) {
+                        badCaptures[badCount++] = moves[index - 1];
+                        continue;
+                    }
+                    return move;
+                }
+                padScoredMoves(badCaptures + badCount);
+                stage = STAGE_KILLER_1;
+                [[fallthrough]];
+
+            case STAGE_KILLER_1:
+                stage = STAGE_KILLER_2;
+                if (killers[0] != ttMove && killers[0].isQuiet() && isValid(killers[0]))
+                    return killers[0];
+                killers[0] = MOVE_NULL;
+                [[fallthrough]];
+
+            case STAGE_KILLER_2:
+                stage = STAGE_COUNTER_MOVE;
+                if (killers[1] != ttMove && killers[1] != killers[0] && killers[1].isQuiet() && isValid(killers[1]))
+                    return killers[1];
+                killers[1] = MOVE_NULL;
+                [[fallthrough]];
+
+            case STAGE_COUNTER_MOVE:
+                stage = STAGE_GEN_QUIETS;
+                if (counterMove != ttMove && counterMove != killers[0] && counterMove != killers[1] &&
+                    counterMove.isQuiet() && isValid(counterMove))
+                    return counterMove;
+                counterMove = MOVE_NULL;
+                [[fallthrough]];
+
+            case STAGE_GEN_QUIETS:
+                generateScored(GEN_QUIETS);
+                partialInsertionSort(moves, moves + count, -QUIET_SORT_MARGIN * depth);
+                stage = STAGE_QUIETS;
+                [[fallthrough]];
+
+            case STAGE_QUIETS:
+                while (index < count) {
+                    Move move = moves[index++].move();
+                    if (!isSpecial(move))
+                        return move;
+                }
+                stage = STAGE_BAD_CAPTURES;
+                [[fallthrough]];
+
+            case STAGE_BAD_CAPTURES:
+                if (badIndex < badCount) {
+                    std::swap(badCaptures[badIndex], badCaptures[selectBest(badCaptures, badIndex, badCount)]);
+                    return badCaptures[badIndex++].move();
+                }
+                stage = STAGE_DONE;
+                return MOVE_NULL;
+
+            case STAGE_QS_TT_MOVE:
+                stage = inCheck ? STAGE_QS_GEN_EVASIONS : STAGE_QS_GEN_CAPTURES;
+                if ((inCheck || ttMove.isCapture()) && isValid(ttMove))
+                    return ttMove;
+                ttMove = MOVE_NULL;
+                return nextMove();
+
+            case STAGE_QS_GEN_CAPTURES:
+                generateCaptures();
+                stage = STAGE_QS_CAPTURES;
+                [[fallthrough]];
+
+            case STAGE_QS_CAPTURES:
+                while (index < count) {
+                    Move move = nextScored();
+                    if (move != ttMove)
+                        return move;
+                }
+                if (!quietChecks) {
+                    stage = STAGE_DONE;
+                    return MOVE_NULL;
+                }
+                stage = STAGE_QS_GEN_CHECKS;
+                [[fallthrough]];
+
+            case STAGE_QS_GEN_CHECKS:
+                generateScored(GEN_QUIET_CHECKS);
+                stage = STAGE_QS_CHECKS;
+                [[fallthrough]];
+
+            case STAGE_QS_CHECKS:
+                if (index < count)
+                    return nextScored();
+                stage = STAGE_DONE;
+                return MOVE_NULL;
+
+            case STAGE_QS_GEN_EVASIONS:
+                generateScored(GEN_EVASIONS);
+                stage = STAGE_QS_EVASIONS;
+                [[fallthrough]];
+
+            case STAGE_QS_EVASIONS:
+                while (index < count) {
+                    Move move = nextScored();
+                    if (move != ttMove)
+                        return move;
+                }
+                stage = STAGE_DONE;
+                [[fallthrough]];
+
+            default:
+                return MOVE_NULL;
+        }
     }
 };
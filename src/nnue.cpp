@@ -16,9 +16,28 @@
 
 #include "nnue.h"
 #include "position.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <fstream>
 #include <immintrin.h>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define USE_MMAP
+#endif
 
 #include "incbin/incbin.h"
 
@@ -26,56 +45,243 @@ namespace NNUE {
 
     std::string EVALFILE = "corenet.bin";
 
+    bool SHARED_NET = false;
+
     INCBIN(Net, "corenet.bin");
 
-    alignas(64) int16_t L_0_WEIGHTS[L_0_SIZE * L_1_SIZE];
-    alignas(64) int16_t L_0_BIASES[L_1_SIZE];
+    // The parameters point into the memory of the loaded net.
+    const int16_t *L_0_WEIGHTS;
+    const int16_t *L_0_BIASES;
 
-    alignas(64) int16_t L_1_WEIGHTS[L_1_SIZE * 2];
-    alignas(64) int16_t L_1_BIASES[1];
+    int KING_BUCKET[64];
+    int KING_MIRROR[64];
 
-    // Copies accumulator.
-    void Accumulator::loadAccumulator(NNUE::Accumulator &accumulator) {
-        for (Color perspective : {WHITE, BLACK}) {
-#ifdef AVX2
-            for (int i = 0; i < chunkNum; i += 4) {
-                const int offset1 = (i + 0) * regWidth;
-                const int offset2 = (i + 1) * regWidth;
-                const int offset3 = (i + 2) * regWidth;
-                const int offset4 = (i + 3) * regWidth;
-
-                __m256i ac1 = _mm256_load_si256((__m256i *) &accumulator.hiddenLayer[perspective][offset1]);
-                __m256i ac2 = _mm256_load_si256((__m256i *) &accumulator.hiddenLayer[perspective][offset2]);
-                __m256i ac3 = _mm256_load_si256((__m256i *) &accumulator.hiddenLayer[perspective][offset3]);
-                __m256i ac4 = _mm256_load_si256((__m256i *) &accumulator.hiddenLayer[perspective][offset4]);
-
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset1], ac1);
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset2], ac2);
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset3], ac3);
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset4], ac4);
+    // Layer stacks of the architectures which can be loaded, the one in use is selected by the net header.
+    enum Architecture {
+        SHALLOW,
+        SHALLOW_INT8,
+        DEEP
+    };
+
+    struct ArchitectureInfo {
+        const char *name;
+        size_t stackSize;
+    };
+
+    constexpr ArchitectureInfo ARCHITECTURES[3] = {
+            {NET_ARCHITECTURE, ShallowStack::parametersSize()},
+            {NET_ARCHITECTURE_INT8, ShallowInt8Stack::parametersSize()},
+            {NET_ARCHITECTURE_DEEP, DeepStack::parametersSize()}};
+
+    // Describes the parameters of a net, it is read from the header.
+    struct NetLayout {
+        Architecture arch = SHALLOW;
+        int kingBucketCount = DEFAULT_KING_BUCKET_COUNT;
+        uint8_t kingBuckets[64];
+        bool mirrored = false;
+
+        NetLayout() {
+            std::memcpy(kingBuckets, DEFAULT_KING_BUCKETS, sizeof(kingBuckets));
+        }
+    };
+
+    NetLayout currentLayout;
+    ShallowStack shallowStack;
+    ShallowInt8Stack shallowInt8Stack;
+    DeepStack deepStack;
+
+    // Memory holding a net, which is either embedded, mapped from a file or allocated.
+    struct NetMemory {
+        const char *data = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+        bool allocated = false;
+    };
+
+    NetMemory currentNet;
+
+    // Positions of the set bits of every byte, used by the kernels for listing the non-zero input blocks.
+    constexpr auto NON_ZERO_INDICES = [] {
+        std::array<std::array<uint16_t, 8>, 256> indices{};
+        for (int mask = 0; mask < 256; mask++) {
+            int count = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (mask & (1 << bit))
+                    indices[mask][count++] = bit;
             }
+        }
+        return indices;
+    }();
+
+#if defined(DISPATCH)
+
+    // Every instruction set gets its own copy of the kernels, the one to use is selected in init().
+#pragma GCC push_options
+#pragma GCC target("avx2,avx512f,avx512bw")
+#define AVX2
+#define AVX512
+    namespace KernelsAVX512 {
+#include "kernels.h"
+    } // namespace KernelsAVX512
+#undef AVX512
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+    namespace KernelsAVX2 {
+#include "kernels.h"
+    } // namespace KernelsAVX2
+#undef AVX2
+#pragma GCC pop_options
+
+    namespace KernelsGeneric {
+#include "kernels.h"
+    } // namespace KernelsGeneric
+
+    struct KernelTable {
+        const char *name;
+        void (*copyLayer)(int16_t *output, const int16_t *input);
+        void (*addWeights)(int16_t *layer, unsigned int index);
+        void (*subWeights)(int16_t *layer, unsigned int index);
+        void (*updateLayer)(int16_t *output, const int16_t *input, const unsigned int *added, int addCount,
+                            const unsigned int *removed, int removeCount);
+        int32_t (*activate)(const int16_t *input, const int16_t *weights);
+        int32_t (*activateInt8)(const int16_t *input, const int8_t *weights);
+        void (*packHidden)(const int16_t *input, uint8_t *output);
+        void (*affineSparse)(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                             int32_t *output, int outputSize);
+        void (*affineDense)(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                            int32_t *output, int outputSize);
+    };
+
+#define KERNEL_TABLE(name, kernels)                                                                       \
+    {                                                                                                     \
+        name, kernels::copyLayer, kernels::addWeights, kernels::subWeights, kernels::updateLayer,         \
+                kernels::activate, kernels::activateInt8, kernels::packHidden, kernels::affineSparse,     \
+                kernels::affineDense                                                                      \
+    }
+
+    KernelTable kernelTable = KERNEL_TABLE("generic", KernelsGeneric);
+
+    // Selects the kernels of the best instruction set supported by the CPU.
+    void selectKernels() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512bw")) {
+            kernelTable = KERNEL_TABLE("avx512", KernelsAVX512);
+        } else if (__builtin_cpu_supports("avx2")) {
+            kernelTable = KERNEL_TABLE("avx2", KernelsAVX2);
+        } else {
+            kernelTable = KERNEL_TABLE("generic", KernelsGeneric);
+        }
+    }
+
+    inline void copyLayer(int16_t *output, const int16_t *input) {
+        kernelTable.copyLayer(output, input);
+    }
+
+    inline void addWeights(int16_t *layer, unsigned int index) {
+        kernelTable.addWeights(layer, index);
+    }
+
+    inline void subWeights(int16_t *layer, unsigned int index) {
+        kernelTable.subWeights(layer, index);
+    }
+
+    inline void updateLayer(int16_t *output, const int16_t *input, const unsigned int *added, int addCount,
+                            const unsigned int *removed, int removeCount) {
+        kernelTable.updateLayer(output, input, added, addCount, removed, removeCount);
+    }
+
+    int32_t activate(const int16_t *input, const int16_t *weights) {
+        return kernelTable.activate(input, weights);
+    }
+
+    int32_t activateInt8(const int16_t *input, const int8_t *weights) {
+        return kernelTable.activateInt8(input, weights);
+    }
+
+    void packHidden(const int16_t *input, uint8_t *output) {
+        kernelTable.packHidden(input, output);
+    }
+
+    void affineSparse(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                      int32_t *output, int outputSize) {
+        kernelTable.affineSparse(input, inputSize, weights, biases, output, outputSize);
+    }
+
+    void affineDense(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                     int32_t *output, int outputSize) {
+        kernelTable.affineDense(input, inputSize, weights, biases, output, outputSize);
+    }
+
+    const char *getKernelName() {
+        return kernelTable.name;
+    }
+
 #else
-            std::memcpy(hiddenLayer[perspective], accumulator.hiddenLayer[perspective], sizeof(int16_t) * L_1_SIZE * 1);
+
+    namespace Kernels {
+#include "kernels.h"
+    } // namespace Kernels
+
+    using Kernels::addWeights;
+    using Kernels::copyLayer;
+    using Kernels::subWeights;
+    using Kernels::updateLayer;
+
+    int32_t activate(const int16_t *input, const int16_t *weights) {
+        return Kernels::activate(input, weights);
+    }
+
+    int32_t activateInt8(const int16_t *input, const int8_t *weights) {
+        return Kernels::activateInt8(input, weights);
+    }
+
+    void packHidden(const int16_t *input, uint8_t *output) {
+        Kernels::packHidden(input, output);
+    }
+
+    void affineSparse(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                      int32_t *output, int outputSize) {
+        Kernels::affineSparse(input, inputSize, weights, biases, output, outputSize);
+    }
+
+    void affineDense(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                     int32_t *output, int outputSize) {
+        Kernels::affineDense(input, inputSize, weights, biases, output, outputSize);
+    }
+
+    const char *getKernelName() {
+#if defined(AVX512)
+        return "avx512";
+#elif defined(AVX2)
+        return "avx2";
+#else
+        return "generic";
+#endif
+    }
+
 #endif
+
+    // Returns the king square used for indexing the features of a perspective.
+    inline Square getKingSquare(Color perspective, Square wKing, Square bKing) {
+        return perspective == WHITE ? wKing : flipSquare(bKing);
+    }
+
+    // Copies accumulator.
+    void Accumulator::loadAccumulator(const NNUE::Accumulator &accumulator) {
+        for (Color perspective : {WHITE, BLACK}) {
+            copyLayer(hiddenLayer[perspective], accumulator.hiddenLayer[perspective]);
+            computed[perspective] = accumulator.computed[perspective];
         }
     }
 
     // Refreshes the accumulator.
     void Accumulator::refresh(const Position &pos) {
 
-#ifdef AVX2
-        __m256i registers[2][chunkNum];
-        for (Color perspective : {WHITE, BLACK}) {
-            for (int i = 0; i < chunkNum; i++) {
-                const int offset = i * regWidth;
-                registers[perspective][i] = _mm256_load_si256((__m256i *) &L_0_BIASES[offset]);
-            }
-        }
-#else
         for (Color perspective : {WHITE, BLACK}) {
-            std::memcpy(hiddenLayer[perspective], L_0_BIASES, sizeof(int16_t) * L_1_SIZE);
+            copyLayer(hiddenLayer[perspective], L_0_BIASES);
         }
-#endif
 
         Bitboard occ = pos.occupied();
 
@@ -85,120 +291,664 @@ namespace NNUE {
         while (occ) {
             Square sq = occ.popLsb();
             Piece p = pos.pieceAt(sq);
-#ifdef AVX2
             for (Color perspective : {WHITE, BLACK}) {
-                unsigned int index = getInputIndex(perspective, p.color, p.type, sq, ((perspective == WHITE) ? wKing : flipSquare(bKing)));
-                for (int i = 0; i < chunkNum; i++) {
-                    const int offset = i * regWidth;
-                    __m256i we = _mm256_load_si256((__m256i *) &L_0_WEIGHTS[index * L_1_SIZE + offset]);
-                    registers[perspective][i] = _mm256_add_epi16(registers[perspective][i], we);
+                addFeature(perspective, getInputIndex(perspective, p.color, p.type, sq, getKingSquare(perspective, wKing, bKing)));
+            }
+        }
+
+        computed[WHITE] = true;
+        computed[BLACK] = true;
+    }
+
+    // Refreshes a perspective of the accumulator, by updating the cached hidden layer of the king bucket and mirroring.
+    void Accumulator::refresh(const Position &pos, Color perspective, AccumulatorCache &cache) {
+
+        Square king = getKingSquare(perspective, pos.pieces<WHITE, KING>().lsb(), pos.pieces<BLACK, KING>().lsb());
+        AccumulatorCacheEntry &entry = cache.entries[perspective][KING_BUCKET[king] * 2 + (KING_MIRROR[king] != 0)];
+
+        for (Color color : {WHITE, BLACK}) {
+            for (PieceType type : {KING, PAWN, KNIGHT, BISHOP, ROOK, QUEEN}) {
+                Bitboard pieces = pos.pieces(color, type);
+                Bitboard added = pieces & ~entry.pieces[color][type];
+                Bitboard removed = entry.pieces[color][type] & ~pieces;
+
+                while (added) {
+                    addWeights(entry.hiddenLayer, getInputIndex(perspective, color, type, added.popLsb(), king));
+                }
+
+                while (removed) {
+                    subWeights(entry.hiddenLayer, getInputIndex(perspective, color, type, removed.popLsb(), king));
                 }
+
+                entry.pieces[color][type] = pieces;
             }
+        }
 
-#else
-            addFeature(p.color, p.type, sq, wKing, bKing);
-#endif
+        copyLayer(hiddenLayer[perspective], entry.hiddenLayer);
+        computed[perspective] = true;
+    }
+
+    // Computes a perspective of the accumulator from the accumulator of the previous state, by applying the changed features.
+    void Accumulator::update(const Accumulator &prev, const AccumulatorDelta &delta, Color perspective) {
+        const Square king = getKingSquare(perspective, delta.kings[WHITE], delta.kings[BLACK]);
+
+        unsigned int added[4], removed[4];
+
+        for (int i = 0; i < delta.addCount; i++) {
+            const Feature &feature = delta.added[i];
+            added[i] = getInputIndex(perspective, feature.piece.color, feature.piece.type, feature.square, king);
         }
 
-#ifdef AVX2
-        for (Color perspective : {WHITE, BLACK}) {
-            for (int i = 0; i < chunkNum; i++) {
-                const int offset = i * regWidth;
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset], registers[perspective][i]);
-            }
+        for (int i = 0; i < delta.removeCount; i++) {
+            const Feature &feature = delta.removed[i];
+            removed[i] = getInputIndex(perspective, feature.piece.color, feature.piece.type, feature.square, king);
         }
-#endif
+
+        updateLayer(hiddenLayer[perspective], prev.hiddenLayer[perspective], added, delta.addCount, removed, delta.removeCount);
+
+        computed[perspective] = true;
     }
 
     // Adds a feature and forward propagates it to L_1.
-    void Accumulator::addFeature(Color pieceColor, PieceType pieceType, Square sq, Square wKing, Square bKing) {
+    void Accumulator::addFeature(Color perspective, unsigned int index) {
+        addWeights(hiddenLayer[perspective], index);
+    }
+
+    // Removes a feature and forward propagates it to L_1.
+    void Accumulator::removeFeature(Color perspective, unsigned int index) {
+        subWeights(hiddenLayer[perspective], index);
+    }
+
+    // Resets every entry of the cache to an empty board.
+    void AccumulatorCache::reset() {
         for (Color perspective : {WHITE, BLACK}) {
-            unsigned int index = getInputIndex(perspective, pieceColor, pieceType, sq, ((perspective == WHITE) ? wKing : flipSquare(bKing)));
-#ifdef AVX2
-            for (int i = 0; i < chunkNum; i++) {
-                const int offset = i * regWidth;
-                __m256i ac = _mm256_load_si256((__m256i *) &hiddenLayer[perspective][offset]);
-                __m256i we = _mm256_load_si256((__m256i *) &L_0_WEIGHTS[index * L_1_SIZE + offset]);
-                __m256i sum = _mm256_add_epi16(ac, we);
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset], sum);
+            for (AccumulatorCacheEntry &entry : entries[perspective]) {
+                std::memcpy(entry.hiddenLayer, L_0_BIASES, sizeof(int16_t) * L_1_SIZE);
+                std::memset(entry.pieces, 0, sizeof(entry.pieces));
             }
-#else
-            for (int i = 0; i < L_1_SIZE; i++) {
-                hiddenLayer[perspective][i] += L_0_WEIGHTS[index * L_1_SIZE + i];
+        }
+    }
+
+    int32_t activateReference(const int16_t *input, const int16_t *weights) {
+        int32_t output = 0;
+        for (int i = 0; i < L_1_SIZE; i++) {
+            output += ReLU(input[i]) * weights[i];
+        }
+        return output;
+    }
+
+    int32_t activateInt8Reference(const int16_t *input, const int8_t *weights) {
+        int32_t output = 0;
+        for (int i = 0; i < L_1_SIZE; i++) {
+            output += std::clamp(int(input[i]), 0, INT8_QA) * weights[i];
+        }
+        return output;
+    }
+
+    void packHiddenReference(const int16_t *input, uint8_t *output) {
+        for (int i = 0; i < L_1_SIZE; i++) {
+            output[i] = std::clamp(int(input[i]), 0, INT8_QA);
+        }
+    }
+
+    void affineSparseReference(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                               int32_t *output, int outputSize) {
+        for (int o = 0; o < outputSize; o++) {
+            output[o] = biases[o];
+        }
+        for (int block = 0; block < inputSize / 4; block++) {
+            for (int o = 0; o < outputSize; o++) {
+                for (int k = 0; k < 4; k++) {
+                    output[o] += input[block * 4 + k] * weights[(block * outputSize + o) * 4 + k];
+                }
             }
-#endif
         }
     }
 
-    // Removes a feature and forward propagates it to L_1.
-    void Accumulator::removeFeature(Color pieceColor, PieceType pieceType, Square sq, Square wKing, Square bKing) {
-        for (Color perspective : {WHITE, BLACK}) {
-            unsigned int index = getInputIndex(perspective, pieceColor, pieceType, sq, ((perspective == WHITE) ? wKing : flipSquare(bKing)));
-#ifdef AVX2
-            for (int i = 0; i < chunkNum; i++) {
+    void affineDenseReference(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                              int32_t *output, int outputSize) {
+        for (int o = 0; o < outputSize; o++) {
+            output[o] = biases[o];
+            for (int i = 0; i < inputSize; i++) {
+                output[o] += input[i] * weights[o * inputSize + i];
+            }
+        }
+    }
+
+    // Forward propagates the hidden layer through the layer stack of the loaded net.
+    Score Accumulator::forward(Color stm, int pieceCount) {
+        const int16_t *us = hiddenLayer[stm];
+        const int16_t *them = hiddenLayer[1 - stm];
+
+        switch (currentLayout.arch) {
+            case SHALLOW_INT8:
+                return shallowInt8Stack.propagate(us, them, pieceCount);
+            case DEEP:
+                return deepStack.propagate(us, them, pieceCount);
+            default:
+                return shallowStack.propagate(us, them, pieceCount);
+        }
+    }
 
-                const int offset = i * regWidth;
+    constexpr uint64_t HASH_OFFSET_BASIS = 0xcbf29ce484222325ULL;
 
-                __m256i ac = _mm256_load_si256((__m256i *) &hiddenLayer[perspective][offset]);
-                __m256i we = _mm256_load_si256((__m256i *) &L_0_WEIGHTS[index * L_1_SIZE + offset]);
-                __m256i sum = _mm256_sub_epi16(ac, we);
-                _mm256_store_si256((__m256i *) &hiddenLayer[perspective][offset], sum);
+    // Returns the FNV-1a hash of some data, a hash can be continued by passing it as the initial value.
+    uint64_t hashNet(const char *data, size_t size, uint64_t hash = HASH_OFFSET_BASIS) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ uint8_t(data[i])) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    // Returns the size of the parameters of a net.
+    size_t getParametersSize(const NetLayout &layout) {
+        return getFTParametersSize(layout.kingBucketCount) + ARCHITECTURES[layout.arch].stackSize;
+    }
+
+    // Returns the size of a header, version 1 headers end before the king buckets.
+    size_t getHeaderSize(const NetHeader &header) {
+        return header.version == 1 ? NET_HEADER_V1_SIZE : sizeof(NetHeader);
+    }
+
+    // Returns the hash of a net, which covers the king buckets and the flags of version 2 headers.
+    uint64_t hashNet(const NetHeader &header, const char *parameters, size_t size) {
+        uint64_t hash = HASH_OFFSET_BASIS;
+        if (header.version != 1) {
+            hash = hashNet(reinterpret_cast<const char *>(header.kingBuckets), sizeof(header.kingBuckets), hash);
+            hash = hashNet(reinterpret_cast<const char *>(&header.flags), sizeof(header.flags), hash);
+        }
+        return hashNet(parameters, size, hash);
+    }
+
+    // Returns the architecture named by a net header, or false if it isn't supported.
+    bool findArchitecture(const NetHeader &header, Architecture &arch) {
+        for (Architecture a : {SHALLOW, SHALLOW_INT8, DEEP}) {
+            if (std::strncmp(header.architecture, ARCHITECTURES[a].name, sizeof(header.architecture)) == 0) {
+                arch = a;
+                return true;
             }
+        }
+        return false;
+    }
+
+    // Reads the layout of a net from its header, or returns an error if it isn't supported.
+    bool readLayout(const NetHeader &header, NetLayout &layout, std::string &error) {
+        layout = NetLayout();
+        if (!findArchitecture(header, layout.arch) || header.hiddenSize != L_1_SIZE || header.outputSize != 1) {
+            error = "architecture mismatch";
+            return false;
+        }
+
+        if (header.version != 1) {
+            layout.kingBucketCount = int(header.kingBucketCount);
+            layout.mirrored = header.flags & NET_MIRRORED;
+            std::memcpy(layout.kingBuckets, header.kingBuckets, sizeof(layout.kingBuckets));
+        }
+
+        bool bucketsOk = layout.kingBucketCount >= 1 && layout.kingBucketCount <= MAX_KING_BUCKET_COUNT &&
+                         header.kingBucketCount == uint32_t(layout.kingBucketCount) &&
+                         header.inputSize == uint32_t(layout.kingBucketCount * 768) && (header.flags & ~NET_MIRRORED) == 0;
+        for (uint8_t bucket : layout.kingBuckets) {
+            bucketsOk &= bucket < layout.kingBucketCount;
+        }
+
+        if (!bucketsOk) {
+            error = "invalid king buckets";
+            return false;
+        }
+        return true;
+    }
+
+    // Returns a header describing the layout of a net.
+    NetHeader getNetHeader(const char *parameters, const NetLayout &layout) {
+        NetHeader header = {};
+        header.magic = NET_MAGIC;
+        header.version = NET_VERSION;
+        std::memcpy(header.architecture, ARCHITECTURES[layout.arch].name, sizeof(header.architecture));
+        header.inputSize = layout.kingBucketCount * 768;
+        header.hiddenSize = L_1_SIZE;
+        header.outputSize = 1;
+        header.kingBucketCount = layout.kingBucketCount;
+        std::memcpy(header.kingBuckets, layout.kingBuckets, sizeof(header.kingBuckets));
+        header.flags = layout.mirrored ? NET_MIRRORED : 0;
+        header.hash = hashNet(header, parameters, getParametersSize(layout));
+        return header;
+    }
+
+    // Allocates a 64 byte aligned copy of a net.
+    NetMemory copyNet(const char *data, size_t size) {
+        char *copy = static_cast<char *>(operator new[](size, std::align_val_t(64)));
+        std::memcpy(copy, data, size);
+        return {copy, size, false, true};
+    }
+
+    // Maps a net file into memory, or reads it where mapping isn't available.
+    bool openNet(const std::string &path, NetMemory &memory) {
+#ifdef USE_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+            return false;
+
+        memory = {static_cast<const char *>(data), size_t(st.st_size), true, false};
+        return true;
 #else
-            for (int i = 0; i < L_1_SIZE; i++) {
-                hiddenLayer[perspective][i] -= L_0_WEIGHTS[index * L_1_SIZE + i];
-            }
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+
+        size_t size = file.tellg();
+        char *data = static_cast<char *>(operator new[](size, std::align_val_t(64)));
+        file.seekg(0);
+        file.read(data, size);
+
+        memory = {data, size, false, true};
+        return true;
+#endif
+    }
+
+    void releaseNet(NetMemory &memory) {
+#ifdef USE_MMAP
+        if (memory.mapped) {
+            munmap(const_cast<char *>(memory.data), memory.size);
+        }
+#endif
+        if (memory.allocated) {
+            operator delete[](const_cast<char *>(memory.data), std::align_val_t(64));
+        }
+        memory = {};
+    }
+
+    // Reads the header at the start of some memory, the part of it which doesn't fit is zeroed.
+    NetHeader readHeader(const char *data, size_t size) {
+        NetHeader header = {};
+        std::memcpy(&header, data, std::min(size, sizeof(NetHeader)));
+        if (header.version == 1) {
+            std::memset(reinterpret_cast<char *>(&header) + NET_HEADER_V1_SIZE, 0, sizeof(NetHeader) - NET_HEADER_V1_SIZE);
+        }
+        return header;
+    }
+
+    // Returns the offset and the layout of the parameters in a net, or an error if the net isn't supported.
+    bool validateNet(const NetMemory &memory, size_t &offset, NetLayout &layout, std::string &error) {
+        // Legacy nets are raw parameters
+        if (memory.size == NET_PARAMETERS_SIZE) {
+            offset = 0;
+            layout = NetLayout();
+            return true;
+        }
+
+        if (memory.size < NET_HEADER_V1_SIZE) {
+            error = "file is too small";
+            return false;
+        }
+
+        NetHeader header = readHeader(memory.data, memory.size);
+
+        if (header.magic != NET_MAGIC) {
+            error = "not a BlackCore net";
+        } else if (header.version < 1 || header.version > NET_VERSION) {
+            error = "unsupported version " + std::to_string(header.version);
+        } else if (memory.size < getHeaderSize(header)) {
+            error = "file is too small";
+        } else if (!readLayout(header, layout, error)) {
+            return false;
+        } else if (memory.size != getHeaderSize(header) + getParametersSize(layout)) {
+            error = "size mismatch";
+        } else if (header.hash != hashNet(header, memory.data + getHeaderSize(header), getParametersSize(layout))) {
+            error = "hash mismatch";
+        } else {
+            offset = getHeaderSize(header);
+            return true;
+        }
+
+        return false;
+    }
+
+#ifdef __linux__
+    // Seconds after which a shared segment, which hasn't been resized by its creator, is considered stale.
+    constexpr time_t SHARED_NET_CREATE_TIMEOUT = 10;
+
+    // Returns the name of the shared memory segment of a net, which is derived from the identity of the file and
+    // the user, so every user shares the nets only between their own processes.
+    std::string getSharedNetName(const std::string &path) {
+        struct stat st;
+        uint64_t hash;
+        if (stat(path.c_str(), &st) == 0) {
+            uint64_t key[4] = {uint64_t(st.st_dev), uint64_t(st.st_ino), uint64_t(st.st_size),
+                               uint64_t(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec};
+            hash = hashNet(reinterpret_cast<const char *>(key), sizeof(key));
+        } else {
+            hash = hashNet(reinterpret_cast<const char *>(gNetData), gNetSize);
+        }
+
+        char name[64];
+        std::snprintf(name, sizeof(name), "/blackcore-net-%u-%016llx", unsigned(geteuid()),
+                      (unsigned long long) hash);
+        return name;
+    }
+
+    // Releases the lock of a shared memory segment and closes it. The mapping keeps the open file alive, so closing
+    // the descriptor alone wouldn't release the lock.
+    void unlockSharedNet(int fd) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    // Maps a shared memory segment read-only, if it holds a complete net. The segment is only used if it is owned
+    // by the user, and its parameters are hashed again as it isn't read from the net file.
+    bool mapSharedNet(int fd, NetMemory &memory, NetLayout &layout) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_uid != geteuid() || size_t(st.st_size) < sizeof(NetHeader))
+            return false;
+
+        const size_t size = st.st_size;
+        void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            return false;
+
+        // The magic is written last by the creator, so a segment which was left unfilled is skipped.
+        const char *segment = static_cast<const char *>(data);
+        NetHeader header = readHeader(segment, size);
+        std::string error;
+        if (header.magic != NET_MAGIC || header.version != NET_VERSION || !readLayout(header, layout, error) ||
+            size != sizeof(NetHeader) + getParametersSize(layout) ||
+            header.hash != hashNet(header, segment + sizeof(NetHeader), getParametersSize(layout))) {
+            munmap(data, size);
+            return false;
+        }
+
+        memory = {segment, size, true, false};
+        return true;
+    }
+
+    // Attaches to the shared memory segment of a net, if another process has already created it. The creator
+    // holds an exclusive lock on the segment while filling it, which is waited for.
+    bool attachSharedNet(const std::string &name, NetMemory &memory, NetLayout &layout) {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd == -1)
+            return false;
+
+        bool attached = flock(fd, LOCK_SH) == 0 && mapSharedNet(fd, memory, layout);
+        unlockSharedNet(fd);
+        return attached;
+    }
+
+    bool createSharedNet(const std::string &name, const char *parameters, const NetLayout &layout, NetMemory &memory,
+                         bool replace = true);
+
+    /*
+     * Handles a segment, which already existed when it was created. Its creator may still be filling it, so its
+     * lock is waited for first. It is only replaced if it is known to be stale: it is still incomplete, but
+     * it has been resized, which its creator only does after taking the lock, so the creator died while filling
+     * it. A segment, which hasn't been resized yet, is only stale after SHARED_NET_CREATE_TIMEOUT seconds.
+     */
+    bool replaceSharedNet(const std::string &name, const char *parameters, const NetLayout &layout,
+                          NetMemory &memory) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd == -1)
+            return false;
+
+        NetLayout sharedLayout;
+        if (flock(fd, LOCK_EX) == -1) {
+            close(fd);
+            return false;
+        }
+        if (mapSharedNet(fd, memory, sharedLayout)) {
+            unlockSharedNet(fd);
+            return true;
+        }
+
+        // The segment is only removed, if another process hasn't replaced it meanwhile.
+        struct stat st, named;
+        bool stale = fstat(fd, &st) == 0 && st.st_uid == geteuid() &&
+                     (st.st_size != 0 || time(nullptr) - st.st_ctim.tv_sec > SHARED_NET_CREATE_TIMEOUT);
+        int namedFd = shm_open(name.c_str(), O_RDONLY, 0);
+        stale &= namedFd != -1 && fstat(namedFd, &named) == 0 && named.st_ino == st.st_ino;
+        if (namedFd != -1)
+            close(namedFd);
+
+        if (stale)
+            shm_unlink(name.c_str());
+        unlockSharedNet(fd);
+
+        return stale && createSharedNet(name, parameters, layout, memory, false);
+    }
+
+    // Creates the shared memory segment of a net and maps it read-only. The segment is locked exclusively until it
+    // is filled. If it already exists, it is attached to or replaced once, when it is stale.
+    bool createSharedNet(const std::string &name, const char *parameters, const NetLayout &layout, NetMemory &memory,
+                         bool replace) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1 && errno == EEXIST && replace)
+            return replaceSharedNet(name, parameters, layout, memory);
+        if (fd == -1)
+            return false;
+
+        const size_t size = sizeof(NetHeader) + getParametersSize(layout);
+        void *data = MAP_FAILED;
+        if (flock(fd, LOCK_EX) == 0 && ftruncate(fd, size) == 0) {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        if (data == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            unlockSharedNet(fd);
+            return false;
+        }
+
+        NetHeader header = getNetHeader(parameters, layout);
+        char *segment = static_cast<char *>(data);
+        std::memcpy(segment + sizeof(NetHeader), parameters, getParametersSize(layout));
+        std::memcpy(segment + sizeof(uint32_t), reinterpret_cast<const char *>(&header) + sizeof(uint32_t),
+                    sizeof(NetHeader) - sizeof(uint32_t));
+        __atomic_store_n(reinterpret_cast<uint32_t *>(segment), header.magic, __ATOMIC_RELEASE);
+
+        unlockSharedNet(fd);
+
+        mprotect(data, size, PROT_READ);
+        memory = {segment, size, true, false};
+        return true;
+    }
+
+    // Removes the shared memory segment of a net, processes already attached to it keep their mapping.
+    void removeSharedNet(const std::string &path) {
+        shm_unlink(getSharedNetName(path).c_str());
+    }
 #endif
+
+    // Points the parameters into a loaded net.
+    void useNet(const NetMemory &memory, size_t offset, const NetLayout &layout) {
+        releaseNet(currentNet);
+        currentNet = memory;
+        currentLayout = layout;
+
+        for (int sq = 0; sq < 64; sq++) {
+            KING_BUCKET[sq] = layout.kingBuckets[sq];
+            KING_MIRROR[sq] = layout.mirrored && sq % 8 >= 4 ? 7 : 0;
+        }
+
+        const char *parameters = currentNet.data + offset;
+        L_0_WEIGHTS = reinterpret_cast<const int16_t *>(parameters);
+        L_0_BIASES = L_0_WEIGHTS + layout.kingBucketCount * 768 * L_1_SIZE;
+
+        const char *stackParameters = parameters + getFTParametersSize(layout.kingBucketCount);
+        switch (layout.arch) {
+            case SHALLOW:
+                shallowStack.map(stackParameters);
+                break;
+            case SHALLOW_INT8:
+                shallowInt8Stack.map(stackParameters);
+                break;
+            case DEEP:
+                deepStack.map(stackParameters);
+                break;
         }
     }
 
-    // Forward propagates L_1 to L_2.
-    Score Accumulator::forward(Color stm) {
+    /*
+     * Loads the net from a file, if the file doesn't exist the embedded net is loaded.
+     * A rejected file leaves the current net in use and false is returned.
+     * With SHARED_NET the parameters are kept in a shared memory segment, the first process loading
+     * a net creates it and the later ones attach to it without reading and parsing the file.
+     */
+    bool loadNet(const std::string &path) {
+#ifdef __linux__
+        const std::string sharedName = SHARED_NET ? getSharedNetName(path) : "";
+        NetMemory shared;
+        NetLayout sharedLayout;
+        if (SHARED_NET && attachSharedNet(sharedName, shared, sharedLayout)) {
+            useNet(shared, sizeof(NetHeader), sharedLayout);
+            return true;
+        }
+#endif
 
-        int32_t output = L_1_BIASES[0];
+        NetMemory memory;
+        if (!openNet(path, memory)) {
+            memory = {reinterpret_cast<const char *>(gNetData), gNetSize, false, false};
+        }
 
-        if (stm == WHITE) {
-            for (int i = 0; i < L_1_SIZE; i++) {
-                output += ReLU(hiddenLayer[WHITE][i]) * L_1_WEIGHTS[i];
+        size_t offset = 0;
+        NetLayout layout;
+        std::string error;
+        if (!validateNet(memory, offset, layout, error)) {
+            std::cout << "info string EvalFile " << path << " rejected: " << error << std::endl;
+            releaseNet(memory);
+            if (currentNet.data == nullptr && !path.empty()) {
+                return loadNet("");
             }
+            return false;
+        }
 
-            for (int i = 0; i < L_1_SIZE; i++) {
-                output += ReLU(hiddenLayer[BLACK][i]) * L_1_WEIGHTS[L_1_SIZE + i];
+        if (SHARED_NET) {
+#ifdef __linux__
+            if (createSharedNet(sharedName, memory.data + offset, layout, shared)) {
+                releaseNet(memory);
+                useNet(shared, sizeof(NetHeader), layout);
+                return true;
             }
-        } else {
-            for (int i = 0; i < L_1_SIZE; i++) {
-                output += ReLU(hiddenLayer[BLACK][i]) * L_1_WEIGHTS[i];
+#endif
+            std::cout << "info string SharedNet isn't available, the net is loaded privately" << std::endl;
+        }
+
+        // The kernels use aligned loads, so the parameters are only used in place if they are aligned.
+        if (reinterpret_cast<uintptr_t>(memory.data + offset) % 64 != 0) {
+            NetMemory copy = copyNet(memory.data + offset, getParametersSize(layout));
+            releaseNet(memory);
+            memory = copy;
+            offset = 0;
+        }
+
+        useNet(memory, offset, layout);
+        return true;
+    }
+
+    /*
+     * Returns the parameters of an int16 net quantized into the int8 variant. The conversion is lossy: the
+     * feature transformer is rescaled from 255 to INT8_QA, and clipping the neurons changes the activation.
+     * Nets trained with clipped ReLU should be quantized by the trainer instead.
+     */
+    std::vector<char> quantizeInt8(NetLayout &layout) {
+        layout.arch = SHALLOW_INT8;
+        std::vector<char> parameters(getParametersSize(layout));
+        const ShallowStack::Bucket &bucket = shallowStack.buckets[0];
+
+        const int ftSize = layout.kingBucketCount * 768 * L_1_SIZE + L_1_SIZE;
+        int16_t *weights = reinterpret_cast<int16_t *>(parameters.data());
+        for (int i = 0; i < ftSize; i++) {
+            weights[i] = int16_t(std::lround(L_0_WEIGHTS[i] * INT8_QA / 255.0));
+        }
+
+        int8_t *outputWeights = reinterpret_cast<int8_t *>(weights + ftSize);
+        for (int i = 0; i < L_1_SIZE * 2; i++) {
+            outputWeights[i] = int8_t(std::clamp(std::lround(bucket.outputWeights[i] * INT8_QB / 255.0), -128L, 127L));
+        }
+
+        int32_t outputBias = std::lround(bucket.outputBias[0] * double(INT8_QA * INT8_QB) / (255 * 255));
+        std::memcpy(outputWeights + L_1_SIZE * 2, &outputBias, sizeof(int32_t));
+
+        return parameters;
+    }
+
+    /*
+     * Returns the parameters of a net with mirrored input, which evaluates the same as the current net. Every king
+     * bucket is split into a bucket for the a-d files and one for the e-h files, the weights of the latter are
+     * mirrored, so the mirrored features index the original weights. Trainers can use it as a starting point.
+     */
+    std::vector<char> mirrorInput(NetLayout &layout) {
+        const int bucketCount = layout.kingBucketCount;
+        layout.kingBucketCount = 2 * bucketCount;
+        layout.mirrored = true;
+        for (int sq = 0; sq < 64; sq++) {
+            layout.kingBuckets[sq] += sq % 8 >= 4 ? bucketCount : 0;
+        }
+
+        std::vector<char> parameters(getParametersSize(layout));
+        int16_t *weights = reinterpret_cast<int16_t *>(parameters.data());
+        for (int bucket = 0; bucket < layout.kingBucketCount; bucket++) {
+            for (int feature = 0; feature < 768; feature++) {
+                int mirroredFeature = bucket >= bucketCount ? feature ^ 7 : feature;
+                const int16_t *source = L_0_WEIGHTS + ((bucket % bucketCount) * 768 + mirroredFeature) * L_1_SIZE;
+                std::memcpy(weights + (bucket * 768 + feature) * L_1_SIZE, source, sizeof(int16_t) * L_1_SIZE);
             }
+        }
+
+        std::memcpy(weights + layout.kingBucketCount * 768 * L_1_SIZE, L_0_BIASES, sizeof(int16_t) * L_1_SIZE);
+        std::memcpy(parameters.data() + getFTParametersSize(layout.kingBucketCount),
+                    reinterpret_cast<const char *>(L_0_WEIGHTS) + getFTParametersSize(bucketCount),
+                    ARCHITECTURES[layout.arch].stackSize);
 
-            for (int i = 0; i < L_1_SIZE; i++) {
-                output += ReLU(hiddenLayer[WHITE][i]) * L_1_WEIGHTS[L_1_SIZE + i];
+        return parameters;
+    }
+
+    // Writes the current net into a versioned net file, converting it if requested. An int16 net can be quantized
+    // into the int8 variant, and the input of a net without mirroring can be mirrored.
+    bool writeNet(const std::string &path, NetConversion conversion) {
+        std::vector<char> converted;
+        const char *parameters = reinterpret_cast<const char *>(L_0_WEIGHTS);
+        NetLayout layout = currentLayout;
+
+        if (conversion == INT8_OUTPUT) {
+            if (layout.arch != SHALLOW) {
+                std::cout << "info string The net can't be converted to int8" << std::endl;
+                return false;
+            }
+            converted = quantizeInt8(layout);
+            parameters = converted.data();
+        } else if (conversion == MIRRORED_INPUT) {
+            if (layout.mirrored || 2 * layout.kingBucketCount > MAX_KING_BUCKET_COUNT) {
+                std::cout << "info string The input of the net can't be mirrored" << std::endl;
+                return false;
             }
+            converted = mirrorInput(layout);
+            parameters = converted.data();
         }
 
-        // Scales back the output with the quantization scales.
-        return output * 200 / (255 * 255);
+        NetHeader header = getNetHeader(parameters, layout);
+
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(NetHeader));
+        file.write(parameters, getParametersSize(layout));
+        return bool(file);
     }
 
     void init() {
 
-        FILE *file = fopen(EVALFILE.c_str(), "rb");
+#if defined(DISPATCH)
+        selectKernels();
+#endif
 
-        if (file != nullptr) {
-            // Loads values from an external net.
-            fread(L_0_WEIGHTS, sizeof(int16_t), L_0_SIZE * L_1_SIZE, file);
-            fread(L_0_BIASES, sizeof(int16_t), L_1_SIZE, file);
-            fread(L_1_WEIGHTS, sizeof(int16_t), L_1_SIZE * 2, file);
-            fread(L_1_BIASES, sizeof(int16_t), 1, file);
-        } else {
-            // Loads values from the embedded net.
-            int ptr = 0;
-            std::memcpy(L_0_WEIGHTS, gNetData + ptr, sizeof(int16_t) * L_0_SIZE * L_1_SIZE);
-            ptr += sizeof(int16_t) * L_0_SIZE * L_1_SIZE;
-            std::memcpy(L_0_BIASES, gNetData + ptr, sizeof(int16_t) * L_1_SIZE);
-            ptr += sizeof(int16_t) * L_1_SIZE;
-            std::memcpy(L_1_WEIGHTS, gNetData + ptr, sizeof(int16_t) * L_1_SIZE * 2);
-            ptr += sizeof(int16_t) * L_1_SIZE * 2;
-            std::memcpy(L_1_BIASES, gNetData + ptr, sizeof(int16_t) * 1);
-        }
+        loadNet(EVALFILE);
     }
 } // namespace NNUE
@@ -17,6 +17,9 @@
 #pragma once
 
 #include "bitboard.h"
+#include <algorithm>
+#include <string>
+#include <type_traits>
 
 class Position;
 
@@ -34,19 +37,23 @@ namespace NNUE {
  * L_0_WEIGHTS = in features -> L_1 (768 -> 256)
  * L_0_BIASES = L_1 biases
  *
- * L_1_WEIGHTS = 2xL_1 -> L_2 (2x256 -> 1)
- * L_1_BIASES = L_2 biases
+ * The layers after L_1 are described by LayerStack.
  *
  */
 
     extern std::string EVALFILE;
 
-    constexpr int KING_BUCKET_COUNT = 4;
-    constexpr int L_0_SIZE = KING_BUCKET_COUNT * 768;
+    // If true the net is kept in shared memory, which is used by every engine process loading the same net
+    extern bool SHARED_NET;
+
+    constexpr int DEFAULT_KING_BUCKET_COUNT = 4;
+    constexpr int MAX_KING_BUCKET_COUNT = 16;
+    constexpr int L_0_SIZE = DEFAULT_KING_BUCKET_COUNT * 768;
     constexpr int L_1_SIZE = 384;
 
+    // King buckets of legacy and version 1 nets, indexed by the king square seen from the perspective
     // clang-format off
-    constexpr int KING_BUCKET[64]{
+    constexpr uint8_t DEFAULT_KING_BUCKETS[64]{
         0, 0, 0, 0, 1, 1, 1, 1,
         0, 0, 0, 0, 1, 1, 1, 1,
         0, 0, 0, 0, 1, 1, 1, 1,
@@ -58,30 +65,170 @@ namespace NNUE {
     };
     // clang-format on
 
+    // King buckets of the loaded net, indexed by the king square seen from the perspective
+    extern int KING_BUCKET[64];
+
+    // Xor applied to the squares of a perspective, which is 7 while a mirrored net flips the board horizontally
+    extern int KING_MIRROR[64];
+
+    /*
+     * Net file format
+     *
+     * A versioned net starts with a header, followed by L_0_WEIGHTS and L_0_BIASES as little endian int16_t
+     * arrays, then the parameters of the layer stack named by the architecture of the header. The header keeps the
+     * parameters 64 byte aligned, so a mapped file can be used in place. Version 2 headers also store the king bucket
+     * layout and whether the input is mirrored horizontally, version 1 headers are only the first 64 bytes of it and
+     * use the default layout. Legacy nets without a header are only accepted if their size matches the default
+     * layout and the shallow architecture exactly.
+     */
+    constexpr uint32_t NET_MAGIC = 0x4E4E4342; // "BCNN"
+    constexpr uint32_t NET_VERSION = 2;
+    constexpr size_t NET_HEADER_V1_SIZE = 64;
+    constexpr uint32_t NET_MIRRORED = 1;
+    constexpr char NET_ARCHITECTURE[32] = "2x(3072->384)->1 ReLU";
+    constexpr char NET_ARCHITECTURE_INT8[32] = "2x(3072->384)->1 CReLU int8";
+    constexpr char NET_ARCHITECTURE_DEEP[32] = "2x(3072->384)->16->32->1 x8";
+
+    // Returns the size of L_0_WEIGHTS and L_0_BIASES in a net with a number of king buckets.
+    constexpr size_t getFTParametersSize(int kingBucketCount) {
+        return sizeof(int16_t) * (kingBucketCount * 768 * L_1_SIZE + L_1_SIZE);
+    }
+
+    constexpr size_t FT_PARAMETERS_SIZE = getFTParametersSize(DEFAULT_KING_BUCKET_COUNT);
+
+    // Quantization of the layers using clipped ReLU, neurons are activated into [0, INT8_QA] and weights are
+    // scaled by INT8_QB, so the sums of a layer are shifted back by WEIGHT_SHIFT before the next activation.
+    constexpr int INT8_QA = 127;
+    constexpr int INT8_QB = 64;
+    constexpr int WEIGHT_SHIFT = 6;
+
+    struct NetHeader {
+        uint32_t magic;
+        uint32_t version;
+        char architecture[32];
+        uint32_t inputSize;
+        uint32_t hiddenSize;
+        uint32_t outputSize;
+        uint32_t kingBucketCount;
+        uint64_t hash; // FNV-1a hash of the king buckets, the flags and the parameters
+        uint8_t kingBuckets[64];
+        uint32_t flags;
+        uint8_t padding[60];
+    };
+
+    static_assert(sizeof(NetHeader) == 192);
+
     constexpr int regWidth = 256 / 16;
     constexpr int chunkNum = L_1_SIZE / regWidth;
 
+    // A piece on a square, which is an input feature of the NNUE.
+    struct Feature {
+        Piece piece;
+        Square square;
+
+        constexpr bool operator==(const Feature &feature) const {
+            return piece.type == feature.piece.type && piece.color == feature.piece.color && square == feature.square;
+        }
+    };
+
+    // Stores the features changed by a move. They are only applied to the accumulator, when it's needed for an evaluation.
+    struct AccumulatorDelta {
+        Feature added[4], removed[4];
+        int addCount = 0, removeCount = 0;
+
+        // King squares after the move
+        Square kings[2];
+
+        // True if the king of the perspective changed its bucket or mirroring, and the accumulator can't be updated incrementally
+        bool refresh[2] = {false, false};
+
+        inline void clear() {
+            addCount = 0;
+            removeCount = 0;
+            refresh[WHITE] = false;
+            refresh[BLACK] = false;
+        }
+
+        // Records an added feature, cancels it out with a previous removal of the same feature.
+        inline void add(Piece piece, Square square) {
+            Feature feature = {piece, square};
+            for (int i = 0; i < removeCount; i++) {
+                if (removed[i] == feature) {
+                    removed[i] = removed[--removeCount];
+                    return;
+                }
+            }
+            added[addCount++] = feature;
+        }
+
+        // Records a removed feature, cancels it out with a previous addition of the same feature.
+        inline void remove(Piece piece, Square square) {
+            Feature feature = {piece, square};
+            for (int i = 0; i < addCount; i++) {
+                if (added[i] == feature) {
+                    added[i] = added[--addCount];
+                    return;
+                }
+            }
+            removed[removeCount++] = feature;
+        }
+    };
+
+    /*
+     * Finny table
+     *
+     * Stores the last refreshed hidden layer of every king bucket, mirroring and perspective, together with the pieces
+     * it was computed from. A refresh only has to apply the difference between the cached and the current pieces,
+     * which is much cheaper than rebuilding the hidden layer from the biases.
+     */
+    struct AccumulatorCacheEntry {
+        alignas(64) int16_t hiddenLayer[L_1_SIZE];
+        Bitboard pieces[2][6];
+    };
+
+    struct AccumulatorCache {
+        AccumulatorCacheEntry entries[2][2 * MAX_KING_BUCKET_COUNT];
+
+        void reset();
+    };
+
     // Stores the hidden layer of the NNUE.
     struct Accumulator {
-        alignas(32) int16_t hiddenLayer[2][L_1_SIZE];
+        alignas(64) int16_t hiddenLayer[2][L_1_SIZE];
+
+        // True if the hidden layer of the perspective is up-to-date with the position
+        bool computed[2] = {false, false};
 
         constexpr Accumulator() {}
 
-        void loadAccumulator(Accumulator &accumulator);
+        void loadAccumulator(const Accumulator &accumulator);
 
         void refresh(const Position &pos);
 
-        void addFeature(Color pieceColor, PieceType pieceType, Square sq, Square wKing, Square bKing);
+        void refresh(const Position &pos, Color perspective, AccumulatorCache &cache);
 
-        void removeFeature(Color pieceColor, PieceType pieceType, Square sq, Square wKing, Square bKing);
+        void update(const Accumulator &prev, const AccumulatorDelta &delta, Color perspective);
 
-        Score forward(Color stm);
+        void addFeature(Color perspective, unsigned int index);
+
+        void removeFeature(Color perspective, unsigned int index);
+
+        Score forward(Color stm, int pieceCount);
     };
 
     // Returns the L_0 index of a feature.
-    constexpr int getInputIndex(Color perspective, Color pieceColor, PieceType pieceType, Square sq, Square kingSquare) {
+    inline int getInputIndex(Color perspective, Color pieceColor, PieceType pieceType, Square sq, Square kingSquare) {
         return (perspective == WHITE ? pieceColor : 1 - pieceColor) * 384 + pieceType * 64 +
-               (perspective == WHITE ? sq : sq ^ 56) + KING_BUCKET[kingSquare] * 768;
+               ((perspective == WHITE ? sq : sq ^ 56) ^ KING_MIRROR[kingSquare]) + KING_BUCKET[kingSquare] * 768;
+    }
+
+    // Returns true if a king move changes the bucket or the mirroring of its perspective.
+    inline bool isRefreshNeeded(Color perspective, Square from, Square to) {
+        if (perspective == BLACK) {
+            from = flipSquare(from);
+            to = flipSquare(to);
+        }
+        return KING_BUCKET[from] != KING_BUCKET[to] || KING_MIRROR[from] != KING_MIRROR[to];
     }
 
     // Activation function used in BlackCore's NNUE.
@@ -89,5 +236,217 @@ namespace NNUE {
         return std::max((int16_t) 0, in);
     }
 
+    // Returns the dot product of an activated hidden layer and the L_1 weights belonging to it.
+    int32_t activate(const int16_t *input, const int16_t *weights);
+
+    // Scalar implementation of activate, which the vectorized versions have to match.
+    int32_t activateReference(const int16_t *input, const int16_t *weights);
+
+    // Returns the dot product of a hidden layer activated by clipped ReLU and int8 L_1 weights.
+    int32_t activateInt8(const int16_t *input, const int8_t *weights);
+
+    // Scalar implementation of activateInt8, which the vectorized versions have to match.
+    int32_t activateInt8Reference(const int16_t *input, const int8_t *weights);
+
+    // Activates the hidden layer by clipped ReLU and packs it into bytes.
+    void packHidden(const int16_t *input, uint8_t *output);
+
+    // Scalar implementation of packHidden, which the vectorized versions have to match.
+    void packHiddenReference(const int16_t *input, uint8_t *output);
+
+    // Propagates a mostly zero input through a dense layer, whose weights are stored in blocks of 4 inputs
+    // for every output. Only the columns of the non-zero blocks are multiplied, which are found with a
+    // SIMD compare. The input size has to be a multiple of 64 and at most 2 * L_1_SIZE, the output size
+    // a multiple of 8 and at most 64.
+    void affineSparse(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                      int32_t *output, int outputSize);
+
+    // Scalar implementation of affineSparse, which the vectorized versions have to match.
+    void affineSparseReference(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                               int32_t *output, int outputSize);
+
+    // Propagates an input through a dense layer, whose weights are stored row by row for every output.
+    void affineDense(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                     int32_t *output, int outputSize);
+
+    // Scalar implementation of affineDense, which the vectorized versions have to match.
+    void affineDenseReference(const uint8_t *input, int inputSize, const int8_t *weights, const int32_t *biases,
+                              int32_t *output, int outputSize);
+
+    // Activates the sums of a dense layer by clipped ReLU, zeroing the padding after them.
+    inline void clippedReLU(const int32_t *input, uint8_t *output, int size, int paddedSize) {
+        for (int i = 0; i < size; i++) {
+            output[i] = std::clamp(input[i] >> WEIGHT_SHIFT, 0, INT8_QA);
+        }
+        for (int i = size; i < paddedSize; i++) {
+            output[i] = 0;
+        }
+    }
+
+    // Returns the size of a layer input, rounded up to a 256-bit register of bytes.
+    constexpr int paddedSize(int size) {
+        return (size + 31) / 32 * 32;
+    }
+
+    /*
+     * Layer stack
+     *
+     * The hidden layers of both perspectives are activated and concatenated into 2 * L_1_SIZE neurons, which are
+     * propagated through dense layers of HIDDEN_1 and HIDDEN_2 neurons into a single output. Every layer after the
+     * feature transformer has OUTPUT_BUCKETS sets of parameters, the set used is chosen by the number of pieces.
+     * A hidden size of 0 leaves the layer out, which makes the shallow nets configurations of the same template.
+     *
+     * FTWeight is the type of the weights connected to the feature transformer: int16_t activates it by ReLU,
+     * like the original nets, int8_t by clipped ReLU. Dense layers always use clipped ReLU and int8 weights.
+     *
+     * For every bucket the file stores the weights and biases of the first hidden layer, the second hidden layer
+     * and the output. The weights of the first hidden layer are grouped in blocks of 4 inputs for every output,
+     * the other weights are stored row by row with padded inputs. Weights start at 64 byte aligned offsets.
+     */
+    template<typename FTWeight, int HIDDEN_1, int HIDDEN_2, int OUTPUT_BUCKETS>
+    struct LayerStack {
+        static_assert(std::is_same_v<FTWeight, int8_t> || HIDDEN_1 == 0);
+        static_assert(HIDDEN_1 % 8 == 0 && HIDDEN_1 <= 64 && (HIDDEN_1 > 0 || HIDDEN_2 == 0));
+
+        using OutputWeight = std::conditional_t<HIDDEN_1 == 0, FTWeight, int8_t>;
+        using OutputBias = std::conditional_t<std::is_same_v<FTWeight, int16_t>, int16_t, int32_t>;
+
+        static constexpr int OUTPUT_INPUT_SIZE =
+                HIDDEN_2 > 0 ? paddedSize(HIDDEN_2) : (HIDDEN_1 > 0 ? paddedSize(HIDDEN_1) : 2 * L_1_SIZE);
+
+        struct Bucket {
+            const int8_t *hidden1Weights = nullptr;
+            const int32_t *hidden1Biases = nullptr;
+            const int8_t *hidden2Weights = nullptr;
+            const int32_t *hidden2Biases = nullptr;
+            const OutputWeight *outputWeights = nullptr;
+            const OutputBias *outputBias = nullptr;
+        };
+
+        Bucket buckets[OUTPUT_BUCKETS];
+
+        // Calls visit(array, length, aligned) for the parameter arrays in file order.
+        template<typename Visitor>
+        constexpr void forEachParameter(Visitor visit) {
+            for (Bucket &bucket : buckets) {
+                if constexpr (HIDDEN_1 > 0) {
+                    visit(bucket.hidden1Weights, 2 * L_1_SIZE * HIDDEN_1, true);
+                    visit(bucket.hidden1Biases, HIDDEN_1, false);
+                }
+                if constexpr (HIDDEN_2 > 0) {
+                    visit(bucket.hidden2Weights, paddedSize(HIDDEN_1) * HIDDEN_2, true);
+                    visit(bucket.hidden2Biases, HIDDEN_2, false);
+                }
+                visit(bucket.outputWeights, OUTPUT_INPUT_SIZE, true);
+                visit(bucket.outputBias, 1, false);
+            }
+        }
+
+        // Returns the size of the parameters after the feature transformer.
+        static constexpr size_t parametersSize() {
+            LayerStack stack;
+            size_t offset = 0;
+            stack.forEachParameter([&](auto *&array, size_t length, bool aligned) {
+                if (aligned)
+                    offset = (offset + 63) / 64 * 64;
+                offset += length * sizeof(*array);
+            });
+            return offset;
+        }
+
+        // Points the layers into the parameters, which have to start at a 64 byte aligned address.
+        void map(const char *data) {
+            size_t offset = 0;
+            forEachParameter([&](auto *&array, size_t length, bool aligned) {
+                if (aligned)
+                    offset = (offset + 63) / 64 * 64;
+                array = reinterpret_cast<std::remove_reference_t<decltype(array)>>(data + offset);
+                offset += length * sizeof(*array);
+            });
+        }
+
+        static constexpr int getBucket(int pieceCount) {
+            return std::min((pieceCount - 1) * OUTPUT_BUCKETS / 32, OUTPUT_BUCKETS - 1);
+        }
+
+        // Propagates the hidden layers of the side to move and the other side to the output. The reference
+        // version only uses the scalar kernels.
+        template<bool reference = false>
+        Score propagate(const int16_t *us, const int16_t *them, int pieceCount) const {
+            const Bucket &bucket = buckets[getBucket(pieceCount)];
+
+            if constexpr (std::is_same_v<FTWeight, int16_t>) {
+                auto dot = reference ? activateReference : activate;
+                int32_t output = bucket.outputBias[0];
+                output += dot(us, bucket.outputWeights);
+                output += dot(them, bucket.outputWeights + L_1_SIZE);
+
+                // Scales back the output with the quantization scales.
+                return output * 200 / (255 * 255);
+            } else if constexpr (HIDDEN_1 == 0) {
+                auto dot = reference ? activateInt8Reference : activateInt8;
+                int32_t output = bucket.outputBias[0];
+                output += dot(us, bucket.outputWeights);
+                output += dot(them, bucket.outputWeights + L_1_SIZE);
+                return output * 200 / (INT8_QA * INT8_QB);
+            } else {
+                auto pack = reference ? packHiddenReference : packHidden;
+                auto sparse = reference ? affineSparseReference : affineSparse;
+                auto dense = reference ? affineDenseReference : affineDense;
+
+                alignas(64) uint8_t input[2 * L_1_SIZE];
+                alignas(64) int32_t sums1[HIDDEN_1];
+                alignas(64) uint8_t hidden1[paddedSize(HIDDEN_1)];
+
+                pack(us, input);
+                pack(them, input + L_1_SIZE);
+
+                sparse(input, 2 * L_1_SIZE, bucket.hidden1Weights, bucket.hidden1Biases, sums1, HIDDEN_1);
+                clippedReLU(sums1, hidden1, HIDDEN_1, paddedSize(HIDDEN_1));
+
+                const uint8_t *last = hidden1;
+
+                alignas(64) int32_t sums2[std::max(HIDDEN_2, 1)];
+                alignas(64) uint8_t hidden2[paddedSize(std::max(HIDDEN_2, 1))];
+                if constexpr (HIDDEN_2 > 0) {
+                    dense(hidden1, paddedSize(HIDDEN_1), bucket.hidden2Weights, bucket.hidden2Biases, sums2, HIDDEN_2);
+                    clippedReLU(sums2, hidden2, HIDDEN_2, paddedSize(HIDDEN_2));
+                    last = hidden2;
+                }
+
+                int32_t output;
+                dense(last, OUTPUT_INPUT_SIZE, bucket.outputWeights, bucket.outputBias, &output, 1);
+                return output * 200 / (INT8_QA * INT8_QB);
+            }
+        }
+    };
+
+    // Configurations of the layer stack, which can be loaded
+    using ShallowStack = LayerStack<int16_t, 0, 0, 1>;
+    using ShallowInt8Stack = LayerStack<int8_t, 0, 0, 1>;
+    using DeepStack = LayerStack<int8_t, 16, 32, 8>;
+
+    constexpr size_t NET_PARAMETERS_SIZE = FT_PARAMETERS_SIZE + ShallowStack::parametersSize();
+
+    // Returns the name of the instruction set used by the NNUE kernels.
+    const char *getKernelName();
+
+    bool loadNet(const std::string &path);
+
+    // Conversions applied to the current net by writeNet
+    enum NetConversion {
+        NO_CONVERSION,
+        INT8_OUTPUT,
+        MIRRORED_INPUT
+    };
+
+    bool writeNet(const std::string &path, NetConversion conversion = NO_CONVERSION);
+
+#ifdef __linux__
+    std::string getSharedNetName(const std::string &path);
+
+    void removeSharedNet(const std::string &path);
+#endif
+
     void init();
 } // namespace NNUE
\ No newline at end of file
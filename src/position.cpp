@@ -39,6 +39,8 @@ void Position::clearPosition() {
     allPieceBB[WHITE] = 0;
     allPieceBB[BLACK] = 0;
 
+    accumulatorCache.reset();
+
     states.clear();
     state->lastIrreversibleMove = state;
 }
@@ -64,6 +66,37 @@ void Position::undoNullMove() {
     states.pop();
 }
 
+/*
+ * Lazy accumulator updates
+ *
+ * Making a move only records the changed features, as many nodes are pruned before being evaluated.
+ * For both perspectives find the closest computed ancestor and apply the recorded deltas from there on.
+ * If the king of the perspective changed its bucket in between, refresh the current accumulator instead.
+ */
+void Position::updateAccumulator() const {
+    BoardState *curr = state;
+
+    for (Color perspective : {WHITE, BLACK}) {
+        if (curr->accumulator.computed[perspective])
+            continue;
+
+        BoardState *st = curr;
+        while (!st->accumulator.computed[perspective] && !st->delta.refresh[perspective] && st != states.stateStart) {
+            st--;
+        }
+
+        if (!st->accumulator.computed[perspective]) {
+            curr->accumulator.refresh(*this, perspective, accumulatorCache);
+            continue;
+        }
+
+        while (st != curr) {
+            (st + 1)->accumulator.update(st->accumulator, (st + 1)->delta, perspective);
+            st++;
+        }
+    }
+}
+
 // Returns true if one more instance of this position was found before.
 bool Position::isRepetition() {
     for (BoardState *ptr = state->lastIrreversibleMove; ptr != state; ptr++) {
@@ -139,11 +172,12 @@ void Position::displayEval() {
             Piece piece = pieceAt(square);
             string evalStr = " ";
             if (!piece.isNull() && piece.type != KING) {
-                clearSquare<true>(square);
+                clearSquare<false>(square);
+                getState()->accumulator.refresh(*this);
                 Score newScore = eval(*this);
                 Score scoreDiff = score - newScore;
                 evalStr = std::to_string(scoreDiff);
-                setSquare<true>(square, piece);
+                setSquare<false>(square, piece);
             }
             cout << std::setw(5) << evalStr << "|";
         }
@@ -152,6 +186,8 @@ void Position::displayEval() {
     cout << "   +-----+-----+-----+-----+-----+-----+-----+-----+\n"
          << std::endl;
 
+    getState()->accumulator.refresh(*this);
+
     cout << "Eval: " << score << std::endl;
 }
 
@@ -300,4 +336,7 @@ void Position::loadFromPosition(const Position &position) {
     for (int idx = 0; idx < 500; idx++) {
         states.stateStart[idx].lastIrreversibleMove = states.stateStart + (position.states.stateStart[idx].lastIrreversibleMove - position.states.stateStart);
     }
+
+    // The cache may have been filled by an earlier search with a different net.
+    accumulatorCache.reset();
 }
\ No newline at end of file
@@ -34,6 +34,7 @@ struct BoardState {
     BoardState *lastIrreversibleMove = nullptr; // Pointer to the last irreversible state.
 
     NNUE::Accumulator accumulator = {}; // NNUE accumulator
+    NNUE::AccumulatorDelta delta = {};  // Features changed by the last move
 
     constexpr BoardState() = default;
 
@@ -56,11 +57,15 @@ struct StateStack {
         currState->lastIrreversibleMove = currState;
     }
 
-    inline void push(BoardState newState) {
-        newState.lastIrreversibleMove = currState->lastIrreversibleMove;
-        newState.accumulator.loadAccumulator(currState->accumulator);
+    // Pushes a new state, the accumulator is left to be computed lazily from the recorded delta.
+    inline void push(BoardState &newState) {
+        BoardState *lastIrreversibleMove = currState->lastIrreversibleMove;
         currState++;
-        *currState = newState;
+        currState->load(newState);
+        currState->lastIrreversibleMove = lastIrreversibleMove;
+        currState->accumulator.computed[WHITE] = false;
+        currState->accumulator.computed[BLACK] = false;
+        currState->delta.clear();
     }
 
     inline void pop() {
@@ -199,6 +204,9 @@ public:
         states.reset();
     }
 
+    // Brings the NNUE accumulator of the current state up-to-date
+    void updateAccumulator() const;
+
     // Returns the Zobrist hash of the position
     [[nodiscard]] inline U64 getHash() const {
         return state->hash;
@@ -245,12 +253,22 @@ public:
     // Returns the least valuable 'stm' color piece among 'attackers'
     Bitboard leastValuablePiece(Bitboard attackers, Color stm, PieceType &type) const;
 
+    // Returns true if a move, which wasn't generated in the position, could be made by the side to move
+    // ignoring the safety of the king. Defined in movegen.cpp.
+    bool isPseudoLegal(Move move) const;
+
+    // Returns true if a pseudo-legal move doesn't leave the king in check. Defined in movegen.cpp.
+    bool isLegal(Move move) const;
+
     Position();
 
     Position(const std::string &fen);
 
     StateStack states;
 
+    // Cache of the NNUE hidden layers used for refreshing the accumulator
+    mutable NNUE::AccumulatorCache accumulatorCache;
+
 private:
     template<bool updateAccumulator>
     void clearSquare(Square square);
@@ -305,9 +323,7 @@ void Position::clearSquare(Square square) {
     state->hash ^= pieceRandTable[12 * square + 6 * piece.color + piece.type];
 
     if constexpr (updateAccumulator) {
-        Square wKing = pieces<WHITE, KING>().lsb();
-        Square bKing = pieces<BLACK, KING>().lsb();
-        state->accumulator.removeFeature(piece.color, piece.type, square, wKing, bKing);
+        state->delta.remove(piece, square);
     }
 }
 
@@ -323,9 +339,7 @@ void Position::setSquare(Square square, Piece piece) {
         state->hash ^= pieceRandTable[12 * square + 6 * p.color + p.type];
 
         if constexpr (updateAccumulator) {
-            Square wKing = pieces<WHITE, KING>().lsb();
-            Square bKing = pieces<BLACK, KING>().lsb();
-            state->accumulator.removeFeature(p.color, p.type, square, wKing, bKing);
+            state->delta.remove(p, square);
         }
     }
 
@@ -336,9 +350,7 @@ void Position::setSquare(Square square, Piece piece) {
     state->hash ^= pieceRandTable[12 * square + 6 * piece.color + piece.type];
 
     if constexpr (updateAccumulator) {
-        Square wKing = pieces<WHITE, KING>().lsb();
-        Square bKing = pieces<BLACK, KING>().lsb();
-        state->accumulator.addFeature(piece.color, piece.type, square, wKing, bKing);
+        state->delta.add(piece, square);
     }
 }
 
@@ -440,8 +452,11 @@ void Position::makeMove(Move move) {
         setSquare<true>(to, piece);
     }
 
-    if (pieceAt(to).type == KING && NNUE::KING_BUCKET[from] != NNUE::KING_BUCKET[to]) {
-        state->accumulator.refresh(*this);
+    state->delta.kings[WHITE] = pieces<WHITE, KING>().lsb();
+    state->delta.kings[BLACK] = pieces<BLACK, KING>().lsb();
+
+    if (pieceAt(to).type == KING && NNUE::isRefreshNeeded(color, from, to)) {
+        state->delta.refresh[color] = true;
     }
 }
 
@@ -25,35 +25,173 @@
 
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <thread>
 
 // Move index -> depth
 Depth reductions[200][MAX_PLY + 1];
 
-std::mutex mNodesSearched;
-U64 nodesSearched[64][64];
+void iterativeDeepening(int id, Depth depth);
 
-std::vector<ThreadData> tds;
-std::vector<std::thread> ths;
+/*
+ * Search thread pool
+ *
+ * The threads are only started when the number of threads changes, between searches they sleep on a condition
+ * variable. Their ThreadData, and with it the history tables, is kept until then. Besides the search they also
+ * run the clearing of the transposition table, so its pages are first touched by the threads probing them.
+ */
+struct ThreadPool {
+    std::vector<ThreadData> tds;
+    std::vector<std::thread> ths;
+
+    std::mutex mutex;
+    std::condition_variable wakeUp, finished;
+    U64 generation = 0;         // Number of jobs started
+    unsigned int searching = 0; // Number of threads, which haven't finished the current job
+    std::function<void(int)> job;
+    bool exiting = false;
+
+    ~ThreadPool() {
+        resize(0);
+    }
+
+    // Waits for a job to start, and runs it on the thread with the given id.
+    void idleLoop(int id, U64 searched) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUp.wait(lock, [&] { return exiting || generation != searched; });
+            if (exiting)
+                return;
+
+            searched = generation;
+            std::function<void(int)> currentJob = job;
+            lock.unlock();
+
+            currentJob(id);
+
+            lock.lock();
+            searching--;
+            finished.notify_all();
+        }
+    }
+
+    // Stops the current threads and starts 'threadCount' new ones with cleared ThreadData.
+    void resize(unsigned int threadCount) {
+        wait();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            exiting = true;
+        }
+        wakeUp.notify_all();
+        for (std::thread &th : ths) {
+            th.join();
+        }
+        ths.clear();
+        tds.clear();
+        exiting = false;
+
+        tds = std::vector<ThreadData>(threadCount);
+        for (unsigned int idx = 0; idx < threadCount; idx++) {
+            tds[idx].threadId = idx;
+            tds[idx].clearHistory();
+            ths.emplace_back(&ThreadPool::idleLoop, this, idx, generation);
+        }
+    }
+
+    // Wakes up every thread to run 'newJob' with its id.
+    void start(std::function<void(int)> newJob) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = std::move(newJob);
+            searching = tds.size();
+            generation++;
+        }
+        wakeUp.notify_all();
+    }
+
+    // Waits until every thread finished its job.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return searching == 0; });
+    }
+
+    // Waits until every helper thread finished its search, only called by the main thread before it finishes.
+    void waitHelpers() {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return searching <= 1; });
+    }
+};
+
+ThreadPool threadPool;
+std::vector<ThreadData> &tds = threadPool.tds;
+
+// Runs 'job' with the id of every search thread in parallel, and waits for them to finish.
+void runOnThreads(const std::function<void(int)> &job) {
+    threadPool.wait();
+    threadPool.start(job);
+    threadPool.wait();
+}
+
+// Sets the number of search threads, which also clear the transposition table. The threads are only restarted
+// if their number changed, otherwise their ThreadData is reused.
+void setThreadCount(int threadCount) {
+    joinThreads(false);
+
+    if (tds.size() != (unsigned int) threadCount)
+        threadPool.resize(threadCount);
+
+    ttSetThreadCount(threadCount, runOnThreads);
+}
 
 // Sums up the node count of individual threads
 U64 getTotalNodes() {
     U64 totalNodes = 0;
     for (ThreadData &td : tds) {
-        totalNodes += td.nodes;
+        totalNodes += td.getNodes();
     }
     return totalNodes;
 }
 
+// Sums up the nodes searched after a root move by the individual threads
+U64 getTotalRootNodes(Move move) {
+    U64 totalNodes = 0;
+    for (ThreadData &td : tds) {
+        totalNodes += td.getRootNodes(move);
+    }
+    return totalNodes;
+}
+
+// Sums up the transposition table statistics of individual threads
+TTStats getTotalTTStats() {
+    TTStats stats;
+    for (ThreadData &td : tds) {
+        stats += td.ttStats;
+    }
+    return stats;
+}
+
 // Sumps up the TB hits of individual threads
 U64 getTotalTBHits() {
     U64 totalHits = 0;
     for (ThreadData &td : tds) {
-        totalHits += td.tbHits;
+        totalHits += td.tbHits.load(std::memory_order_relaxed);
     }
     return totalHits;
 }
 
+// Returns true if the search should stop. The main thread checks the limits every LIMIT_CHECK_INTERVAL nodes it
+// searched, so the node counters of the other threads are only read there, the helper threads only read the flag.
+inline bool shouldEnd(ThreadData &td) {
+    if (td.threadId == 0 && td.getNodes() >= td.nextLimitCheck) {
+        td.nextLimitCheck = td.getNodes() + LIMIT_CHECK_INTERVAL;
+        checkLimits(getTotalNodes());
+    }
+    return stopped.load(std::memory_order_relaxed);
+}
+
 // Initialize a lookup table for LMR reduction values
 void initLmr() {
     for (int moveIndex = 0; moveIndex < 200; moveIndex++) {
@@ -68,9 +206,9 @@ void initLmr() {
  * Static-Exchange-Evaluation
  *
  * Returns the material change, after playing out every resulting capture of the move.
+ * A quiet move captures nothing, so it only checks whether the moved piece can be won.
  */
 bool see(const Position &pos, Move move, Score threshold) {
-    assert(move.isCapture()); // Make sure move is a capture
 
     Square from = move.getFrom();
     Square to = move.getTo();
@@ -133,16 +271,17 @@ bool see(const Position &pos, Move move, Score threshold) {
  *
  * A special type of alpha-beta search, which only searches
  * captures, to improve the tactical stability of the main
- * search.
+ * search. Every evasion is searched when in check, and quiet
+ * checks are searched at the first ply.
  */
 template<NodeType type>
-Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha, Score beta) {
+Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha, Score beta, Depth depth = 0) {
 
     constexpr bool pvNode = type != NON_PV_NODE;
     constexpr bool nonPvNode = !pvNode;
 
     // Check if search should stop by asking the time manager
-    if (shouldEnd(td.nodes, getTotalNodes()))
+    if (shouldEnd(td))
         return UNKNOWN_SCORE;
 
     // Update the maximum depth reached.
@@ -155,7 +294,7 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
      * the transposition table
      */
     bool ttHit = false;
-    TTEntry ttEntry = ttProbe(pos.getHash(), stack->ply, ttHit);
+    TTEntry ttEntry = ttProbe(pos.getHash(), stack->ply, ttHit, td.ttStats);
 
     /*
      * TT cutoffs
@@ -164,22 +303,26 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
      * return the score from the transposition table.
      */
     if (ttHit && nonPvNode && (ttEntry.flag == TT_EXACT || (ttEntry.flag == TT_ALPHA && ttEntry.eval <= alpha) || (ttEntry.flag == TT_BETA && ttEntry.eval >= beta))) {
+        td.ttStats.cutoffs++;
         return ttEntry.eval;
     }
 
-    // Get the evaluation of the position, which will be used as the stand pat score
-    Score bestScore = eval(pos);
-
     // Return the evaluation if maximum ply is reached
     if (stack->ply >= MAX_PLY) {
-        return bestScore;
+        return eval(pos);
     }
 
+    bool inCheck = bool(getAttackers(pos, pos.pieces<KING>(pos.getSideToMove()).lsb()));
+
+    // Get the evaluation of the position, which will be used as the stand pat score
+    Score bestScore = inCheck ? -INF_SCORE : eval(pos);
+
     /*
      * Standing pat
      *
      * As only tactical moves will be evaluated, static evaluation can be used to get a
-     * lower-bound of the position score.
+     * lower-bound of the position score. There is no stand pat when in check, as every
+     * evasion is searched.
      */
 
     if (bestScore >= beta) {
@@ -190,16 +333,18 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
         alpha = bestScore;
     }
 
-    // Generate all legal capture
-    auto moves = MoveList<true, false>(pos, td, MOVE_NULL, stack->ply);
+    // Pick the TT move first, then generate the evasions or the captures and at the first ply the quiet checks
+    MovePicker moves(pos, td, ttHit ? ttEntry.hashMove : MOVE_NULL, inCheck, depth == 0);
 
     EntryFlag ttFlag = TT_ALPHA;
     Move bestMove;
 
-    // Iterate through the generated moves
-    while (!moves.empty()) {
+    // Iterate through the picked moves
+    Move move;
+    unsigned int legalMoves = 0;
+    while ((move = moves.nextMove())) {
 
-        Move move = moves.nextMove();
+        legalMoves++;
 
         /*
          * Delta pruning
@@ -207,29 +352,28 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
          * If the static evaluation and the expected gain of this move plus a large margin is still
          * less than alpha the move can be safely skipped.
          */
-        if (move.isPromo() * PIECE_VALUES[QUEEN] + PIECE_VALUES[pos.pieceAt(move.getTo()).type] +
-                    bestScore + DELTA_MARGIN <
-            alpha)
+        if (!inCheck && move.isPromo() * PIECE_VALUES[QUEEN] + PIECE_VALUES[pos.pieceAt(move.getTo()).type] +
+                                bestScore + DELTA_MARGIN < alpha)
             continue;
 
         /*
          * Static-Exchange-Evaluation pruning
          *
-         * If the move loses material we skip its evaluation
+         * If the move loses material we skip its evaluation, this includes the quiet checks hanging a piece
          */
-        if (bestScore > TB_BEST_LOSS && !see(pos, move, 0))
+        if (!inCheck && bestScore > TB_BEST_LOSS && !see(pos, move, 0))
             continue;
 
-        td.nodes++; // Update total number of nodes searched
+        td.addNode(); // Update total number of nodes searched
 
         pos.makeMove(move);
 
-        Score score = -quiescence<type>(pos, td, stack + 1, -beta, -alpha);
+        Score score = -quiescence<type>(pos, td, stack + 1, -beta, -alpha, depth - 1);
 
         pos.undoMove(move);
 
         // Check if search should stop by asking the time manager
-        if (shouldEnd(td.nodes, getTotalNodes()))
+        if (shouldEnd(td))
             return UNKNOWN_SCORE;
 
         bestScore = std::max(bestScore, score);
@@ -237,7 +381,7 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
         // If the score is too good to be acceptable by our opponent return beta
         if (score >= beta) {
             // If beta cutoff happens save the information to the transposition table
-            ttSave(pos.getHash(), 0, score, TT_BETA, move, stack->ply);
+            ttSave(pos.getHash(), 0, score, TT_BETA, move, stack->ply, td.ttStats);
 
             return beta;
         }
@@ -250,8 +394,13 @@ Score quiescence(Position &pos, ThreadData &td, SearchStack *stack, Score alpha,
         }
     }
 
+    // If there are no legal evasions, it's a checkmate
+    if (inCheck && legalMoves == 0) {
+        return -(MATE_VALUE - stack->ply);
+    }
+
     // Save information to the transposition table
-    ttSave(pos.getHash(), 0, bestScore, ttFlag, bestMove, stack->ply);
+    ttSave(pos.getHash(), 0, bestScore, ttFlag, bestMove, stack->ply, td.ttStats);
     return bestScore;
 }
 
@@ -279,14 +428,14 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
     td.killerMoves[stack->ply + 1][1] = MOVE_NULL;
 
     // Check if search should stop by asking the time manager
-    if (shouldEnd(td.nodes, getTotalNodes()))
+    if (shouldEnd(td))
         return UNKNOWN_SCORE;
 
     if (notRootNode) {
 
         // If a repetition or fifty move rule happens return DRAW_VALUE.
         if (pos.isRepetition() || pos.getMove50() >= 99)
-            return 1 - (td.nodes & 3);
+            return 1 - (td.getNodes() & 3);
 
 
         /*
@@ -307,7 +456,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
      * node is a singular search root skip this step.
      */
     bool ttHit = false;
-    TTEntry ttEntry = isSingularRoot ? TTEntry() : ttProbe(pos.getHash(), stack->ply, ttHit);
+    TTEntry ttEntry = isSingularRoot ? TTEntry() : ttProbe(pos.getHash(), stack->ply, ttHit, td.ttStats);
 
     /*
      * TT cutoffs
@@ -317,6 +466,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
      */
     if (ttHit && nonPvNode && ttEntry.depth >= depth && prevMove.isOk() && pos.getMove50() < 90 &&
         (ttEntry.flag == TT_EXACT || (ttEntry.flag == TT_ALPHA && ttEntry.eval <= alpha) || (ttEntry.flag == TT_BETA && ttEntry.eval >= beta))) {
+        td.ttStats.cutoffs++;
         return ttEntry.eval;
     }
 
@@ -330,7 +480,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
         if (result != TB_RESULT_FAILED) {
             EntryFlag flag = TT_EXACT;
             Score score = DRAW_VALUE;
-            td.tbHits++;
+            td.addTBHit();
 
             if (result == TB_WIN) {
                 flag = TT_BETA;
@@ -341,7 +491,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
             }
 
             if (flag == TT_EXACT || (flag == TT_ALPHA && score <= alpha) || (flag == TT_BETA && score >= beta)) {
-                ttSave(pos.getHash(), depth, score, flag, MOVE_NULL, stack->ply);
+                ttSave(pos.getHash(), depth, score, flag, MOVE_NULL, stack->ply, td.ttStats);
                 return score;
             }
 
@@ -411,6 +561,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
                 Depth R = NULL_MOVE_BASE_R + depth / NULL_MOVE_R_SCALE;
 
                 stack->move = MOVE_NULL;
+                stack->continuationHistory = &td.continuationHistory[NULL_PIECE_INDEX][0];
                 pos.makeNullMove();
                 Score score = -search<NON_PV_NODE>(pos, td, stack + 1, depth - R, -beta, -beta + 1);
                 pos.undoNullMove();
@@ -425,23 +576,22 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
         }
     }
 
-    auto moves = MoveList<false, rootNode>(pos, td, prevMove, stack->ply);
-
-    // If there is no legal moves the position is either a checkmate or a stalemate.
-    if (moves.count == 0) {
-        if (isSingularRoot)
-            return alpha;
-
-        return inCheck ? -matePly : DRAW_VALUE;
-    }
+    // The root moves are ordered by the nodes spent on them, other nodes generate their moves in stages.
+    auto moves = [&]() {
+        if constexpr (rootNode)
+            return RootMoveList(pos, td);
+        else
+            return MovePicker(pos, td, ttHit ? ttEntry.hashMove : MOVE_NULL, stack, depth);
+    }();
 
     Move bestMove;
     EntryFlag ttFlag = TT_ALPHA;
-    Move quiets[64];
-    int index = 0, madeQuiets = 0;
-    while (!moves.empty()) {
+    Move quiets[64], captures[32];
+    int index = 0, madeQuiets = 0, madeCaptures = 0, legalMoves = 0;
+    Move move; // Currently searched move
+    while ((move = moves.nextMove())) {
 
-        Move move = moves.nextMove(); // Currently searched move
+        legalMoves++;
 
         if (move == stack->excludedMove) continue;
 
@@ -453,14 +603,15 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
             if (skip) continue;
         }
 
-        U64 nodesBefore = td.nodes;
+        U64 nodesBefore = td.getNodes();
 
         if (rootNode && td.uciMode && getSearchTime() > 2000) {
             printCurrMove(depth, index, move);
         }
 
         Score score;
-        Score history = td.historyTable[color][move.getFrom()][move.getTo()];
+        Piece piece = pos.pieceAt(move.getFrom());
+        Score history = move.isQuiet() ? td.quietHistory(stack, color, piece, move) : 0;
 
         // Prune quiet moves if ...
         if (notRootNode && nonPvNode && !inCheck && bestScore > TB_BEST_LOSS && move.isQuiet() && !move.isPromo()) {
@@ -475,6 +626,11 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
             // ... many moves had been made before.
             if (depth <= LMP_DEPTH && index >= LMP_MOVES + depth * depth)
                 continue;
+
+            // History pruning
+            // ... the move has been failing low after the previous moves.
+            if (depth <= HISTORY_PRUNING_DEPTH && history < -HISTORY_PRUNING_MARGIN * depth)
+                continue;
         }
 
         // Extensions
@@ -512,10 +668,11 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
         }
 
         stack->move = move;
+        stack->continuationHistory = &td.continuationHistory[pieceIndex(piece)][move.getTo()];
 
         Depth newDepth = depth - 1 + extensions;
 
-        td.nodes++;
+        td.addNode();
         pos.makeMove(move);
 
         ttPrefetch(pos.getHash());
@@ -533,7 +690,7 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
 
             R += !improving;
             R -= pvNode;
-            R -= std::clamp(history / 3000, -1, 1);
+            R -= std::clamp(history / LMR_HISTORY_DIVISOR, -2, 2);
             R -= td.killerMoves[stack->ply][0] == move || td.killerMoves[stack->ply][1] == move || td.counterMoves[prevMove.getFrom()][prevMove.getTo()] == move;
 
             Depth D = std::clamp(newDepth - R, 1, newDepth + 1);
@@ -556,11 +713,11 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
         pos.undoMove(move);
 
         if (rootNode) {
-            td.updateNodesSearched(move, td.nodes - nodesBefore);
+            td.updateRootNodes(move, td.getNodes() - nodesBefore);
         }
 
         // Check if search should stop by asking the time manager
-        if (shouldEnd(td.nodes, getTotalNodes()))
+        if (shouldEnd(td))
             return UNKNOWN_SCORE;
 
         bestScore = std::max(bestScore, score);
@@ -568,21 +725,31 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
         if (score >= beta) {
 
             if (!isSingularRoot) {
+                Score bonus = depth * depth;
                 if (move.isQuiet()) {
 
                     // Update history heuristics
                     td.updateKillerMoves(move, stack->ply);
                     if (prevMove.isOk())
                         td.updateCounterMoves(prevMove, move);
-                    td.updateHH(move, color, depth * depth);
+                    td.updateHH(move, color, bonus);
+                    td.updateContinuationHistory(stack, piece, move, bonus);
 
                     for (int i = 0; i < madeQuiets; i++) {
-                        td.updateHH(quiets[i], color, -depth * depth);
+                        td.updateHH(quiets[i], color, -bonus);
+                        td.updateContinuationHistory(stack, pos.pieceAt(quiets[i].getFrom()), quiets[i], -bonus);
                     }
+                } else {
+                    td.updateCaptureHistory(pos, move, bonus);
+                }
+
+                // The captures searched before the cutoff failed low
+                for (int i = 0; i < madeCaptures; i++) {
+                    td.updateCaptureHistory(pos, captures[i], -bonus);
                 }
 
                 // Save the information gathered into the transposition table.
-                ttSave(pos.getHash(), depth, beta, TT_BETA, move, stack->ply);
+                ttSave(pos.getHash(), depth, beta, TT_BETA, move, stack->ply, td.ttStats);
             }
             return beta;
         }
@@ -600,17 +767,27 @@ Score search(Position &pos, ThreadData &td, SearchStack *stack, Depth depth, Sco
             td.pvLength[stack->ply] = td.pvLength[stack->ply + 1];
         }
 
-        if (move.isQuiet()) {
+        if (move.isQuiet() && madeQuiets < 64) {
             quiets[madeQuiets++] = move;
+        } else if (move.isCapture() && madeCaptures < 32) {
+            captures[madeCaptures++] = move;
         }
         index++;
     }
 
+    // If there is no legal moves the position is either a checkmate or a stalemate.
+    if (legalMoves == 0) {
+        if (isSingularRoot)
+            return alpha;
+
+        return inCheck ? -matePly : DRAW_VALUE;
+    }
+
     bestScore = std::min(bestScore, maxScore);
 
     // Only save the information gathered into the transposition table, if the node isn't a singular search root.
     if (!isSingularRoot)
-        ttSave(pos.getHash(), depth, bestScore, ttFlag, bestMove, stack->ply);
+        ttSave(pos.getHash(), depth, bestScore, ttFlag, bestMove, stack->ply, td.ttStats);
 
     return bestScore;
 }
@@ -639,8 +816,7 @@ Score searchRoot(Position &pos, ThreadData &td, Depth depth) {
         td.variationMoves[i] = Move();
     }
 
-    Move moves[200];
-    int moveCount = generateMoves(pos, moves, false) - moves;
+    int moveCount = countLegalMoves(pos);
 
     for (int multiPV = 0; multiPV < std::min(moveCount, td.multiPV); multiPV++) {
 
@@ -653,6 +829,7 @@ Score searchRoot(Position &pos, ThreadData &td, Depth depth) {
             (stateStack + i)->move = MOVE_NULL;
             (stateStack + i)->eval = UNKNOWN_SCORE;
             (stateStack + i)->ply = i;
+            (stateStack + i)->continuationHistory = &td.continuationHistory[NULL_PIECE_INDEX][0];
         }
 
         // Start at -inf and +inf bounds
@@ -669,7 +846,7 @@ Score searchRoot(Position &pos, ThreadData &td, Depth depth) {
         Score delta = ASPIRATION_DELTA;
         while (true) {
             // Check if search should stop by asking the time manager
-            if (shouldEnd(td.nodes, getTotalNodes()))
+            if (shouldEnd(td))
                 return UNKNOWN_SCORE;
 
             if (alpha <= -ASPIRATION_BOUND)
@@ -728,7 +905,6 @@ void iterativeDeepening(int id, Depth depth) {
     ThreadData &td = tds[id];
     Position &pos = tds[id].position;
 
-    td.reset();
     pos.getState()->accumulator.refresh(pos);
 
     Score prevScore = 0;
@@ -755,7 +931,7 @@ void iterativeDeepening(int id, Depth depth) {
             if (score - prevScore > ASPIRATION_DELTA)
                 factor *= 1.1;
 
-            U64 bestMoveEffort = nodesSearched[td.variationMoves[0].getFrom()][td.variationMoves[0].getTo()];
+            U64 bestMoveEffort = getTotalRootNodes(td.variationMoves[0]);
             double notBestMove = 1.0 - double(bestMoveEffort) / double(getTotalNodes());
             factor *= std::max(0.5, 2 * notBestMove + 0.4);
 
@@ -766,27 +942,36 @@ void iterativeDeepening(int id, Depth depth) {
         bestMove = td.variationMoves[0];
     }
 
+    // Only the main thread ends the search, the helper threads are stopped before their statistics are summed up.
+    if (td.threadId == 0) {
+        stopped = true;
+        threadPool.waitHelpers();
+    }
+
     if (td.uciMode) {
+        TTStats stats = getTotalTTStats();
+        U64 hitRate = stats.probes == 0 ? 0 : stats.hits * 100 / stats.probes;
+        out("info", "string", "tt", "probes", stats.probes, "hits", stats.hits, "hitrate", std::to_string(hitRate) + "%",
+            "cutoffs", stats.cutoffs, "overwrites", stats.overwrites, "collisions", stats.collisions);
         out("bestmove", bestMove);
     }
 
-    stopped = true;
-
     td.result = SearchResult(prevScore, bestMove);
 }
 
-// Join all the threads to the main thread.
+// Waits for every thread to finish its search, which is stopped first unless 'waitToFinish' is set.
 void joinThreads(bool waitToFinish) {
     if (!waitToFinish)
         stopped = true;
 
-    for (std::thread &th : ths) {
-        if (th.joinable())
-            th.join();
-    }
+    threadPool.wait();
+}
 
-    ths.clear();
-    tds.clear();
+// Clears the history tables of the search threads, only called between searches.
+void clearHistory() {
+    for (ThreadData &td : tds) {
+        td.clearHistory();
+    }
 }
 
 // Starts the process of finding the best move.
@@ -794,18 +979,18 @@ SearchResult startSearch(SearchInfo &searchInfo, Position &pos, int threadCount)
 
     joinThreads(false);
 
-    // Initializes ThreadData object for storing variables of threads.
-    for (int idx = 0; idx < threadCount; idx++) {
-        ThreadData td;
-        td.threadId = idx;
-        td.multiPV = idx == 0 ? searchInfo.multiPV : 1;
-        td.uciMode = searchInfo.uciMode && idx == 0;
-        tds.emplace_back(td);
-    }
+    // Entries saved by the previous searches are aged.
+    ttNewSearch();
+
+    setThreadCount(threadCount);
 
-    // Create a copy of the searched position, one for each thread.
-    for (int idx = 0; idx < threadCount; idx++) {
-        tds[idx].position.loadFromPosition(pos);
+    for (ThreadData &td : tds) {
+        td.multiPV = td.threadId == 0 ? searchInfo.multiPV : 1;
+        td.uciMode = searchInfo.uciMode && td.threadId == 0;
+        td.position.loadFromPosition(pos);
+
+        // Reset before any thread starts, so the counters of the previous search aren't summed up.
+        td.reset();
     }
 
     // Initializes time manager.
@@ -821,13 +1006,12 @@ SearchResult startSearch(SearchInfo &searchInfo, Position &pos, int threadCount)
             return {};
     }
 
-    // Starts every thread.
-    for (int idx = 0; idx < threadCount; idx++) {
-        ths.emplace_back(iterativeDeepening, idx, searchInfo.maxDepth);
-    }
+    // Wakes up every thread.
+    Depth maxDepth = searchInfo.maxDepth;
+    threadPool.start([maxDepth](int id) { iterativeDeepening(id, maxDepth); });
 
     if (!searchInfo.uciMode) {
-        ths[0].join();
+        threadPool.wait();
         return tds[0].result;
     }
 
@@ -22,10 +22,22 @@
 #include "uci.h"
 #include <atomic>
 
+// Index of the continuation history tables which are never updated, used after null moves and at the root.
+constexpr int NULL_PIECE_INDEX = 12;
+
+// Returns the index of a piece in the history tables.
+constexpr int pieceIndex(Piece piece) {
+    return piece.color * 6 + piece.type;
+}
+
+// History of the quiet moves following a move, indexed by the piece and the to square of the quiet move.
+typedef Score PieceToHistory[12][64];
+
 struct SearchStack {
     Move move, excludedMove;
     Score eval = 0;
     Ply ply = 0;
+    PieceToHistory *continuationHistory = nullptr; // Table of the moves following 'move'
 };
 
 struct SearchResult {
@@ -42,9 +54,12 @@ U64 getTotalNodes();
 
 void initLmr();
 
+void initMoveSelection();
+
 // Initializes stuff that is needed for a search.
 inline void initSearch() {
     initBitboard();
+    initMoveSelection();
     initLmr();
     NNUE::init();
 }
@@ -53,4 +68,8 @@ bool see(const Position &pos, Move move, Score threshold);
 
 void joinThreads(bool waitToFinish);
 
+void clearHistory();
+
+void setThreadCount(int threadCount);
+
 SearchResult startSearch(SearchInfo &searchInfo, Position &pos, int threadCount);
@@ -15,13 +15,33 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "tests.h"
+#include "eval.h"
+#include "nnue.h"
 #include "search.h"
 #include "timeman.h"
 #include "tt.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Stores positions for perft test
 struct TestPosition {
@@ -30,10 +50,21 @@ struct TestPosition {
     U64 perftResult;
 };
 
-const unsigned int posCount = 10;           // Number of test positions
-const unsigned int benchPosCount = 20;      // Number of bench positions
-const unsigned int searchTestHashSize = 32; // Transposition table size for benchmarking
-const Depth searchTestDepth = 15;           // Depth used in benchmarks
+const unsigned int posCount = 10;                // Number of test positions
+const unsigned int benchPosCount = 20;           // Number of bench positions
+const unsigned int searchTestHashSize = 32;      // Transposition table size for benchmarking
+const Depth searchTestDepth = 15;                // Depth used in benchmarks
+const unsigned int ttStressHashSize = 1;         // Transposition table size for the stress test
+const unsigned int ttStressPoolSize = 1 << 16;   // Number of different hashes used in the stress test
+const U64 ttStressIterations = 1 << 21;          // Number of saves and probes done by each thread in the stress test
+const unsigned int nnueTestIterations = 1 << 14; // Number of random hidden layers checked by the NNUE test
+const unsigned int sparseBenchIterations = 1 << 14; // Number of passes over the inputs timed by the sparse bench
+const unsigned int orderingBenchIterations = 1 << 8; // Number of passes over the move lists timed by the ordering bench
+const Depth orderingBenchDepth = 8;                 // Depth whose quiet sort limit is used by the ordering bench
+
+const Depth moveValidationDepth = 2;               // Depth of the positions whose every move encoding is validated
+const Depth genTypeTestDepth = 3;                  // Depth of the positions whose evasions and quiet checks are tested
+const unsigned int genTypePosCount = 5;            // Number of extra positions for testing evasions and quiet checks
 
 const TestPosition testPositions[posCount] = {
         // Positions from CPW
@@ -48,6 +79,13 @@ const TestPosition testPositions[posCount] = {
         {"rnb1k2r/pppp1ppp/5q2/2b5/2BNP3/2N5/PPP2KPP/R1BQ3R w kq - 1 8", 5, 19782759},
         {"8/pp5p/8/2p2kp1/2Pp4/3P1KPP/PP6/8 w - - 0 32", 7, 13312960}};
 
+const std::string genTypePositions[genTypePosCount] = {
+        {"k7/8/8/8/N7/8/8/R3K3 w - - 0 1"},
+        {"k7/8/8/8/K7/8/8/R7 w - - 0 1"},
+        {"4k3/8/8/4B3/8/8/4R3/4K2q w - - 0 1"},
+        {"8/8/8/2k5/3Pp3/8/8/4K2Q b - d3 0 1"},
+        {"7k/5Q2/6K1/8/8/8/8/8 b - - 0 1"}};
+
 const std::string benchPositions[benchPosCount] = {
         {"r1bq1k1r/pp3pp1/2nP4/7p/3p4/6N1/PPPQ1PPP/2KR1B1R b - - 1 16"},
         {"3Q4/1p3p2/2ppk3/4p2r/2PbP2p/3P3P/rq1BKP2/3R4 w - - 6 32"},
@@ -70,41 +108,260 @@ const std::string benchPositions[benchPosCount] = {
         {"8/3K4/4pk1p/7P/4P3/8/8/8 b - - 4 70"},
         {"8/2p3p1/3n4/1p6/3kpPB1/PP6/2PK1P2/8 w - - 5 45"}};
 
+// Entry of the perft hash table. The key is stored xor-ed with the data, so an entry torn by two threads writing
+// it at the same time doesn't match any position.
+struct PerftEntry {
+    std::atomic<U64> key;
+    std::atomic<U64> data; // Node count in the upper 56 bits, depth in the lower 8 bits
+};
+
+// Hash table storing the node counts of already counted subtrees, shared by the perft threads.
+struct PerftTable {
+    std::unique_ptr<PerftEntry[]> table;
+    U64 mask = 0;
+
+    explicit PerftTable(unsigned int hashSize) {
+        U64 entryCount = 1;
+        while (entryCount * 2 * sizeof(PerftEntry) <= U64(hashSize) * 1024 * 1024) {
+            entryCount *= 2;
+        }
+        table.reset(new PerftEntry[entryCount]());
+        mask = entryCount - 1;
+    }
+
+    inline bool probe(U64 hash, Depth depth, U64 &nodes) const {
+        const PerftEntry &entry = table[hash & mask];
+        U64 data = entry.data.load(std::memory_order_relaxed);
+        if ((entry.key.load(std::memory_order_relaxed) ^ data) != hash || Depth(data & 0xff) != depth)
+            return false;
+        nodes = data >> 8;
+        return true;
+    }
+
+    inline void save(U64 hash, Depth depth, U64 nodes) {
+        PerftEntry &entry = table[hash & mask];
+        U64 data = (nodes << 8) | U64(depth);
+        entry.key.store(hash ^ data, std::memory_order_relaxed);
+        entry.data.store(data, std::memory_order_relaxed);
+    }
+};
+
+// Perft using the hash table for the subtrees of at least depth 2, depth 1 is bulk counted.
+U64 perftHashed(Position &position, Depth depth, PerftTable &table) {
+
+    U64 nodes = 0;
+    if (depth >= 2 && table.probe(position.getHash(), depth, nodes))
+        return nodes;
+
+    if (depth == 1)
+        return countLegalMoves(position);
+
+    Move moves[200];
+    Move *movesEnd = generateMoves(position, moves, false);
+
+    for (Move *it = moves; it != movesEnd; it++) {
+        position.makeMove(*it);
+        nodes += perftHashed(position, depth - 1, table);
+        position.undoMove(*it);
+    }
+
+    table.save(position.getHash(), depth, nodes);
+    return nodes;
+}
+
+/*
+ * Perft splitting the root moves between 'threadCount' threads. Each thread takes the next uncounted root
+ * move, so the threads stay busy even if the subtrees differ in size. The counts of the subtrees are cached
+ * in a hash table of 'hashSize' MB shared by the threads, no table is used if it's 0. Outputs the count of
+ * every root move if 'output' is set.
+ */
+U64 perftParallel(const Position &position, Depth depth, unsigned int threadCount, unsigned int hashSize, bool output) {
+
+    // Depth 1 is bulk counted, unless the count of every root move is printed.
+    if (depth <= 0)
+        return 1;
+    if (depth == 1 && !output)
+        return countLegalMoves(position);
+
+    Move moves[200];
+    Move *movesEnd = generateMoves(position, moves, false);
+    unsigned int moveCount = movesEnd - moves;
+
+    std::unique_ptr<PerftTable> table = hashSize ? std::make_unique<PerftTable>(hashSize) : nullptr;
+    std::vector<U64> splits(moveCount);
+    std::atomic<unsigned int> nextMove = 0;
+
+    auto worker = [&]() {
+        std::unique_ptr<Position> pos = std::make_unique<Position>();
+        pos->loadFromPosition(position);
+        unsigned int index;
+        while ((index = nextMove++) < moveCount) {
+            pos->makeMove(moves[index]);
+            if (depth == 1)
+                splits[index] = 1;
+            else
+                splits[index] = table ? perftHashed(*pos, depth - 1, *table) : perft<false>(*pos, depth - 1);
+            pos->undoMove(moves[index]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    U64 nodes = 0;
+    for (unsigned int i = 0; i < moveCount; i++) {
+        if (output) {
+            std::cout << moves[i] << ": " << splits[i] << std::endl;
+        }
+        nodes += splits[i];
+    }
+    return nodes;
+}
+
+// Returns the number of move encodings in the position and its children up to 'depth', which
+// Position::isPseudoLegal and Position::isLegal judge differently than the move generator.
+U64 testMoveValidation(Position &pos, Depth depth) {
+    static bool generated[64][64][16];
+
+    Move moves[200];
+    Move *movesEnd = generateMoves(pos, moves, false);
+    U64 errors = 0;
+
+    for (Move *it = moves; it != movesEnd; it++) {
+        for (unsigned int flags = 0; flags < 16; flags++) {
+            if (*it == Move(it->getFrom(), it->getTo(), flags))
+                generated[it->getFrom()][it->getTo()][flags] = true;
+        }
+    }
+
+    for (Square from = A1; from < 64; from += 1) {
+        for (Square to = A1; to < 64; to += 1) {
+            for (unsigned int flags = 0; flags < 16; flags++) {
+                Move move = Move(from, to, flags);
+                if (generated[from][to][flags] != (pos.isPseudoLegal(move) && pos.isLegal(move))) {
+                    std::cout << pos.getFen() << " validates " << move << " wrongly" << std::endl;
+                    errors++;
+                }
+            }
+        }
+    }
+
+    std::memset(generated, 0, sizeof(generated));
+
+    if (depth > 1) {
+        for (Move *it = moves; it != movesEnd; it++) {
+            pos.makeMove(*it);
+            errors += testMoveValidation(pos, depth - 1);
+            pos.undoMove(*it);
+        }
+    }
+
+    return errors;
+}
+
+// Returns the number of positions up to 'depth', where the evasion or the quiet check generator doesn't
+// return the same moves as filtering all the legal moves, or the legal moves are counted wrong.
+U64 testGenTypes(Position &pos, Depth depth) {
+    Move moves[200], expected[200], generated[200];
+    Move *movesEnd = generateMoves(pos, moves, GEN_ALL);
+    Move *expectedEnd = expected;
+
+    bool inCheck = bool(getAttackers(pos, pos.pieces<KING>(pos.getSideToMove()).lsb()));
+    for (Move *it = moves; it != movesEnd; it++) {
+        if (inCheck) {
+            *expectedEnd++ = *it;
+        } else if (it->isQuiet() && !it->isPromo() && !it->equalFlag(KING_CASTLE) && !it->equalFlag(QUEEN_CASTLE)) {
+            pos.makeMove(*it);
+            if (getAttackers(pos, pos.pieces<KING>(pos.getSideToMove()).lsb()))
+                *expectedEnd++ = *it;
+            pos.undoMove(*it);
+        }
+    }
+
+    Move *generatedEnd = generateMoves(pos, generated, inCheck ? GEN_EVASIONS : GEN_QUIET_CHECKS);
+    U64 errors = 0;
+
+    if (countLegalMoves(pos) != movesEnd - moves || hasLegalMove(pos) != (movesEnd != moves)) {
+        std::cout << pos.getFen() << " counts the legal moves wrong" << std::endl;
+        errors++;
+    }
+
+    if (generatedEnd - generated != expectedEnd - expected ||
+        std::any_of(expected, expectedEnd, [&](Move move) { return std::find(generated, generatedEnd, move) == generatedEnd; })) {
+        std::cout << pos.getFen() << " generates wrong " << (inCheck ? "evasions" : "quiet checks") << std::endl;
+        errors++;
+    }
+
+    if (depth > 1) {
+        for (Move *it = moves; it != movesEnd; it++) {
+            pos.makeMove(*it);
+            errors += testGenTypes(pos, depth - 1);
+            pos.undoMove(*it);
+        }
+    }
+
+    return errors;
+}
+
 /*
  * Exits the program with exit code -1, if the movegen produces an
- * illegal move. Outputs a nodes per second value, which can be used to determine
- * the speed of the move generator.
+ * illegal move. Outputs a nodes per second value for every position and in total,
+ * which can be used to determine the speed of the move generator and the hardware.
+ * Uses 'threadCount' threads and a perft hash table of 'hashSize' MB.
  */
-void testPerft() {
+void testPerft(unsigned int threadCount, unsigned int hashSize) {
 
     // Initialize values
     initSearch();
-    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-    U64 totalNodes = 0;
+    U64 totalNodes = 0, totalTime = 0;
     bool ok = true;
 
+    std::cout << std::fixed << std::setprecision(1);
+
     // Iterating over the positions
     for (const TestPosition &tPos : testPositions) {
 
         Position pos = {tPos.fen};
-        U64 nodes = perft<false>(pos, tPos.perftDepth);
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        U64 nodes = perftParallel(pos, tPos.perftDepth, threadCount, hashSize, false);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        U64 elapsedTime = std::max<U64>(1, std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count());
+
         totalNodes += nodes;
+        totalTime += elapsedTime;
 
         // If the node count doesn't match with the recorded value notify the user about it.
         if (nodes != tPos.perftResult) {
             ok = false;
             std::cout << tPos.fen << " failed! Result: " << nodes << " Expected: " << tPos.perftResult << std::endl;
+        } else {
+            std::cout << tPos.fen << " " << nodes << " nodes " << double(nodes) / double(elapsedTime) << " Mnps" << std::endl;
         }
     }
 
-    // Stopping the clock and calculating the nps
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-    U64 elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
-    U64 nps = totalNodes * 1000 / elapsedTime;
+    // Validating every move encoding, as the search gets moves from the TT and the killers without generating
+    // them, and the evasion and quiet check generators used by the quiescence search
+    for (const TestPosition &tPos : testPositions) {
+        Position pos = {tPos.fen};
+        if (testMoveValidation(pos, moveValidationDepth) != 0 || testGenTypes(pos, genTypeTestDepth) != 0)
+            ok = false;
+    }
+
+    for (const std::string &fen : genTypePositions) {
+        Position pos = {fen};
+        if (testMoveValidation(pos, moveValidationDepth) != 0 || testGenTypes(pos, genTypeTestDepth) != 0)
+            ok = false;
+    }
 
     if (ok) {
         std::cout << "PERFT OK\n"
-                  << totalNodes << " nodes " << nps << " nps" << std::endl;
+                  << totalNodes << " nodes " << double(totalNodes) / double(totalTime) << " Mnps" << std::endl;
     } else {
         std::cout << "PERFT FAILED" << std::endl;
         exit(1);
@@ -121,8 +378,9 @@ void testSearch(U64 expectedResult) {
 
     for (const std::string &fen : benchPositions) {
 
-        // Clear the transposition table for a deterministic behaviour.
+        // Clear the transposition table and the history tables for a deterministic behaviour.
         ttClear();
+        clearHistory();
 
         Position pos = {fen};
         SearchInfo info;
@@ -149,3 +407,605 @@ void testSearch(U64 expectedResult) {
         }
     }
 }
+
+
+// Returns the entry, which is saved for a hash by the transposition table stress test.
+TTEntry ttStressEntry(U64 hash) {
+    Score eval = Score((hash >> 8) & 0x7fff) - 16384;
+    Move move = Move(Square((hash >> 24) & 63), Square((hash >> 30) & 63), (hash >> 36) & 15);
+    return {hash, eval, move, Depth(hash & 63), TT_EXACT};
+}
+
+/*
+ * Runs many threads concurrently saving and probing a small transposition table. Every thread
+ * saves entries derived from the hash, so a probed entry with a different content means that
+ * a torn entry was accepted. Exits the program with exit code 1 if any mismatch is found.
+ */
+void testTT(int threadCount) {
+
+    std::vector<U64> pool(ttStressPoolSize);
+    std::mt19937_64 rng(RANDOM_SEED);
+    for (U64 &hash : pool) {
+        hash = rng();
+    }
+
+    bool ok = true;
+
+    for (bool bucketed : {true, false}) {
+
+        ttResize(ttStressHashSize);
+        ttSetBucketed(bucketed);
+
+        std::atomic<U64> hits = 0, mismatches = 0;
+        std::vector<std::thread> threads;
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+        for (int id = 0; id < threadCount; id++) {
+            threads.emplace_back([&, id]() {
+                std::mt19937 threadRng(RANDOM_SEED + id);
+                U64 threadHits = 0, threadMismatches = 0;
+                TTStats stats;
+
+                for (U64 i = 0; i < ttStressIterations; i++) {
+                    TTEntry saved = ttStressEntry(pool[threadRng() % ttStressPoolSize]);
+                    ttSave(saved.hash, saved.depth, saved.eval, saved.flag, saved.hashMove, 0, stats);
+
+                    U64 hash = pool[threadRng() % ttStressPoolSize];
+                    bool ttHit = false;
+                    TTEntry probed = ttProbe(hash, 0, ttHit, stats);
+
+                    if (ttHit) {
+                        TTEntry expected = ttStressEntry(hash);
+                        threadHits++;
+                        if (probed.eval != expected.eval || probed.hashMove != expected.hashMove ||
+                            probed.depth != expected.depth || probed.flag != expected.flag) {
+                            threadMismatches++;
+                        }
+                    }
+                }
+
+                hits += threadHits;
+                mismatches += threadMismatches;
+            });
+        }
+
+        for (std::thread &th : threads) {
+            th.join();
+        }
+
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        U64 elapsedTime = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count();
+
+        std::cout << (bucketed ? "Bucketed" : "Single entry") << " layout: " << threadCount << " threads "
+                  << ttStressIterations * threadCount << " probes " << hits << " hits " << mismatches << " mismatches "
+                  << elapsedTime << " ms" << std::endl;
+
+        if (mismatches != 0)
+            ok = false;
+    }
+
+    ttSetBucketed(true);
+
+    if (ok) {
+        std::cout << "TT STRESS OK" << std::endl;
+    } else {
+        std::cout << "TT STRESS FAILED" << std::endl;
+        exit(1);
+    }
+}
+
+/*
+ * Checks that the vectorized forward propagation matches the scalar reference bit-for-bit.
+ * Random hidden layers and weights are bounded so that the exact result fits into 32 bits,
+ * then the hidden layers of the bench positions are checked. Exits the program with exit code 1
+ * if any mismatch is found.
+ */
+void testNNUE() {
+
+    initSearch();
+
+    std::mt19937 rng(RANDOM_SEED);
+    std::uniform_int_distribution<int> fullRange(INT16_MIN, INT16_MAX);
+    std::uniform_int_distribution<int> smallRange(-170, 170);
+
+    alignas(64) int16_t input[NNUE::L_1_SIZE];
+    alignas(64) int16_t weights[NNUE::L_1_SIZE];
+    alignas(64) int8_t weightsInt8[NNUE::L_1_SIZE];
+
+    U64 mismatches = 0, checks = 0;
+
+    auto check = [&](const int16_t *in, const int16_t *we) {
+        for (int j = 0; j < NNUE::L_1_SIZE; j++) {
+            weightsInt8[j] = int8_t(we[j]);
+        }
+        checks += 2;
+        if (NNUE::activate(in, we) != NNUE::activateReference(in, we)) {
+            mismatches++;
+        }
+        if (NNUE::activateInt8(in, weightsInt8) != NNUE::activateInt8Reference(in, weightsInt8)) {
+            mismatches++;
+        }
+    };
+
+    for (unsigned int i = 0; i < nnueTestIterations; i++) {
+        bool smallWeights = i & 1;
+        for (int j = 0; j < NNUE::L_1_SIZE; j++) {
+            input[j] = int16_t(smallWeights ? fullRange(rng) : smallRange(rng));
+            weights[j] = int16_t(smallWeights ? smallRange(rng) : fullRange(rng));
+        }
+        check(input, weights);
+    }
+
+    // Hidden layers which can occur in a game
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        NNUE::Accumulator &accumulator = pos.getState()->accumulator;
+        accumulator.refresh(pos);
+
+        for (Color perspective : {WHITE, BLACK}) {
+            for (int j = 0; j < NNUE::L_1_SIZE; j++) {
+                weights[j] = int16_t(smallRange(rng));
+            }
+            check(accumulator.hiddenLayer[perspective], weights);
+        }
+    }
+
+    // Layer stack with hidden layers, filled with random parameters
+    std::vector<char> stackParameters(NNUE::DeepStack::parametersSize() + 64);
+    char *stackData = stackParameters.data() + (64 - reinterpret_cast<uintptr_t>(stackParameters.data()) % 64);
+    NNUE::DeepStack stack;
+    stack.map(stackData);
+    stack.forEachParameter([&](auto *&array, size_t length, bool) {
+        using Type = std::remove_const_t<std::remove_reference_t<decltype(*array)>>;
+        Type *values = const_cast<Type *>(array);
+        for (size_t j = 0; j < length; j++) {
+            values[j] = sizeof(Type) == 1 ? Type(fullRange(rng)) : Type(smallRange(rng) * 64);
+        }
+    });
+
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        NNUE::Accumulator &accumulator = pos.getState()->accumulator;
+        accumulator.refresh(pos);
+        int pieceCount = pos.occupied().popCount();
+
+        for (Color stm : {WHITE, BLACK}) {
+            const int16_t *us = accumulator.hiddenLayer[stm];
+            const int16_t *them = accumulator.hiddenLayer[1 - stm];
+            checks++;
+            if (stack.propagate(us, them, pieceCount) != stack.propagate<true>(us, them, pieceCount)) {
+                mismatches++;
+            }
+        }
+    }
+
+    std::cout << checks << " checks " << mismatches << " mismatches" << std::endl;
+
+    // A written net has to load back with the same evaluations, while damaged copies are rejected.
+    const std::string netPath = "nnue_test.bin";
+    std::vector<Score> evals;
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        evals.push_back(eval(pos));
+    }
+
+    // Evaluations after every legal move of the bench positions, which are computed incrementally
+    // and have to match a refresh of the accumulator
+    bool netOk = true;
+    auto moveEvals = [&]() {
+        std::vector<Score> result;
+        for (const std::string &fen : benchPositions) {
+            Position pos = {fen};
+            eval(pos);
+            Move moves[200];
+            Move *movesEnd = generateMoves(pos, moves, false);
+            for (Move *it = moves; it != movesEnd; it++) {
+                pos.makeMove(*it);
+                result.push_back(eval(pos));
+                pos.getState()->accumulator.refresh(pos);
+                netOk &= eval(pos) == result.back();
+                pos.undoMove(*it);
+            }
+        }
+        return result;
+    };
+    const std::vector<Score> originalMoveEvals = moveEvals();
+
+    netOk &= NNUE::writeNet(netPath) && NNUE::loadNet(netPath);
+    for (unsigned int i = 0; i < benchPosCount; i++) {
+        Position pos = {benchPositions[i]};
+        netOk &= eval(pos) == evals[i];
+    }
+
+#ifdef __linux__
+    // The first load creates the shared segment and the second one attaches to it.
+    NNUE::SHARED_NET = true;
+    NNUE::removeSharedNet(netPath);
+    for (int load = 0; load < 2; load++) {
+        netOk &= NNUE::loadNet(netPath);
+        for (unsigned int i = 0; i < benchPosCount; i++) {
+            Position pos = {benchPositions[i]};
+            netOk &= eval(pos) == evals[i];
+        }
+    }
+    const std::string sharedName = NNUE::getSharedNetName(netPath);
+    auto sharedInode = [&]() {
+        struct stat st;
+        int fd = shm_open(sharedName.c_str(), O_RDONLY, 0);
+        ino_t inode = fd != -1 && fstat(fd, &st) == 0 ? st.st_ino : 0;
+        if (fd != -1)
+            close(fd);
+        return inode;
+    };
+    auto sharedEvalsOk = [&]() {
+        bool ok = true;
+        for (unsigned int i = 0; i < benchPosCount; i++) {
+            Position pos = {benchPositions[i]};
+            ok &= eval(pos) == evals[i];
+        }
+        return ok;
+    };
+
+    int segmentFd = shm_open(sharedName.c_str(), O_RDWR, 0);
+    struct stat segmentStat;
+    netOk &= segmentFd != -1 && fstat(segmentFd, &segmentStat) == 0;
+    std::vector<char> segment(segmentFd != -1 ? segmentStat.st_size : 0);
+    netOk &= pread(segmentFd, segment.data(), segment.size(), 0) == ssize_t(segment.size());
+
+    // A segment with tampered parameters fails the hash check, and it is replaced by the next load.
+    char tampered = char(segment[sizeof(NNUE::NetHeader) + 1000] ^ 0xff);
+    netOk &= pwrite(segmentFd, &tampered, 1, sizeof(NNUE::NetHeader) + 1000) == 1;
+    close(segmentFd);
+    netOk &= NNUE::loadNet(netPath) && sharedEvalsOk() && sharedInode() != segmentStat.st_ino;
+    NNUE::removeSharedNet(netPath);
+
+    // A segment left without the magic by a dead creator is replaced by the next load.
+    int staleFd = shm_open(sharedName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    netOk &= staleFd != -1 && ftruncate(staleFd, sizeof(NNUE::NetHeader)) == 0;
+    close(staleFd);
+    for (int load = 0; load < 2; load++) {
+        netOk &= NNUE::loadNet(netPath) && sharedEvalsOk();
+    }
+    int sharedFd = shm_open(sharedName.c_str(), O_RDONLY, 0);
+    struct stat sharedStat;
+    netOk &= sharedFd != -1 && fstat(sharedFd, &sharedStat) == 0 && size_t(sharedStat.st_size) == segment.size();
+    close(sharedFd);
+    NNUE::removeSharedNet(netPath);
+
+    // A segment, which is still filled by a live creator holding its lock, is waited for and attached to.
+    int creatorFd = shm_open(sharedName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    struct stat creatorStat;
+    netOk &= creatorFd != -1 && flock(creatorFd, LOCK_EX) == 0 && fstat(creatorFd, &creatorStat) == 0 &&
+             ftruncate(creatorFd, segment.size()) == 0;
+    bool creatorOk = false;
+    std::thread creator([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        creatorOk = pwrite(creatorFd, segment.data(), segment.size(), 0) == ssize_t(segment.size());
+        flock(creatorFd, LOCK_UN);
+        close(creatorFd);
+    });
+    netOk &= NNUE::loadNet(netPath);
+    creator.join();
+    netOk &= creatorOk && sharedEvalsOk() && sharedInode() == creatorStat.st_ino;
+    NNUE::removeSharedNet(netPath);
+    NNUE::SHARED_NET = false;
+#endif
+
+    /*
+     * The int8 variant is detected from the header. Its evaluations have to match a scalar forward pass, which
+     * quantizes the output layer of the int16 net by itself, and its hidden layers have to stay within the
+     * rounding error of the rescaled int16 hidden layers.
+     */
+    constexpr int int16OutputSize = 2 * NNUE::L_1_SIZE * sizeof(int16_t) + sizeof(int16_t);
+    std::vector<char> int16Output(int16OutputSize);
+    std::ifstream int16File(netPath, std::ios::binary);
+    int16File.seekg(-int16OutputSize, std::ios::end);
+    int16File.read(int16Output.data(), int16OutputSize);
+    int16File.close();
+
+    const int16_t *int16Weights = reinterpret_cast<const int16_t *>(int16Output.data());
+    int16_t int16Bias;
+    std::memcpy(&int16Bias, int16Weights + 2 * NNUE::L_1_SIZE, sizeof(int16_t));
+
+    int8_t int8Weights[2 * NNUE::L_1_SIZE];
+    for (int i = 0; i < 2 * NNUE::L_1_SIZE; i++) {
+        int8Weights[i] = int8_t(std::clamp(std::lround(int16Weights[i] * NNUE::INT8_QB / 255.0), -128L, 127L));
+    }
+    const int32_t int8Bias = std::lround(int16Bias * double(NNUE::INT8_QA * NNUE::INT8_QB) / (255 * 255));
+
+    std::vector<int16_t> int16Hidden;
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        NNUE::Accumulator &accumulator = pos.getState()->accumulator;
+        accumulator.refresh(pos);
+        for (Color perspective : {WHITE, BLACK}) {
+            int16Hidden.insert(int16Hidden.end(), accumulator.hiddenLayer[perspective],
+                               accumulator.hiddenLayer[perspective] + NNUE::L_1_SIZE);
+        }
+    }
+
+    netOk &= NNUE::writeNet(netPath, NNUE::INT8_OUTPUT) && NNUE::loadNet(netPath);
+    int64_t int8Error = 0;
+    U64 int8Mismatches = 0;
+    for (unsigned int i = 0; i < benchPosCount; i++) {
+        Position pos = {benchPositions[i]};
+        Score score = eval(pos);
+        int8Error += std::abs(score - evals[i]);
+
+        // Every weight and the bias of the feature transformer are rounded once, at most 32 features are active.
+        const NNUE::Accumulator &accumulator = pos.getState()->accumulator;
+        for (Color perspective : {WHITE, BLACK}) {
+            const int16_t *expected = int16Hidden.data() + (2 * i + perspective) * NNUE::L_1_SIZE;
+            for (int j = 0; j < NNUE::L_1_SIZE; j++) {
+                if (std::abs(accumulator.hiddenLayer[perspective][j] - expected[j] * NNUE::INT8_QA / 255.0) > 17) {
+                    int8Mismatches++;
+                }
+            }
+        }
+
+        Color stm = pos.getSideToMove();
+        int32_t output = int8Bias;
+        for (int j = 0; j < NNUE::L_1_SIZE; j++) {
+            output += std::clamp(int(accumulator.hiddenLayer[stm][j]), 0, NNUE::INT8_QA) * int8Weights[j];
+            output += std::clamp(int(accumulator.hiddenLayer[1 - stm][j]), 0, NNUE::INT8_QA) * int8Weights[NNUE::L_1_SIZE + j];
+        }
+        if (score != output * 200 / (NNUE::INT8_QA * NNUE::INT8_QB)) {
+            int8Mismatches++;
+        }
+    }
+    std::cout << "Int8 variant average eval difference " << int8Error / benchPosCount << " mismatches "
+              << int8Mismatches << std::endl;
+    netOk &= int8Mismatches == 0;
+
+    // Only the int16 variant of the shallow net can be converted to int8.
+    netOk &= !NNUE::writeNet(netPath, NNUE::INT8_OUTPUT);
+
+    // The mirrored conversion has to evaluate the same, also when a king move crosses the d/e files.
+    netOk &= NNUE::loadNet(NNUE::EVALFILE) && NNUE::writeNet(netPath, NNUE::MIRRORED_INPUT) && NNUE::loadNet(netPath);
+    netOk &= moveEvals() == originalMoveEvals;
+
+    netOk &= NNUE::loadNet(NNUE::EVALFILE) && NNUE::writeNet(netPath);
+
+    std::fstream file(netPath, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekg(sizeof(NNUE::NetHeader) + 1000);
+    char byte = char(file.get() ^ 0xff);
+    file.seekp(sizeof(NNUE::NetHeader) + 1000);
+    file.put(byte);
+    file.close();
+    netOk &= !NNUE::loadNet(netPath);
+
+    std::filesystem::resize_file(netPath, 1000);
+    netOk &= !NNUE::loadNet(netPath);
+
+    std::filesystem::remove(netPath);
+    NNUE::init();
+
+    std::cout << "Net loading " << (netOk ? "OK" : "FAILED") << std::endl;
+    if (!netOk)
+        mismatches++;
+
+    if (mismatches == 0) {
+        std::cout << "NNUE OK" << std::endl;
+    } else {
+        std::cout << "NNUE FAILED" << std::endl;
+        exit(1);
+    }
+}
+
+// Compares the speed of the sparse and the dense kernel in the first hidden layer after the feature transformer.
+// The inputs are the activated hidden layers of the bench positions and the weights are random, stored in the
+// layout of both kernels. Exits the program with exit code 1 if their outputs differ.
+void benchSparse() {
+
+    initSearch();
+
+    constexpr int inputSize = 2 * NNUE::L_1_SIZE;
+    constexpr int outputSize = 16;
+
+    struct alignas(64) PackedInput {
+        uint8_t values[inputSize];
+    };
+
+    std::mt19937 rng(RANDOM_SEED);
+    std::uniform_int_distribution<int> weightRange(INT8_MIN, INT8_MAX);
+
+    alignas(64) static int8_t sparseWeights[inputSize * outputSize];
+    alignas(64) static int8_t denseWeights[inputSize * outputSize];
+    alignas(64) int32_t biases[outputSize];
+    alignas(64) int32_t output[outputSize];
+
+    for (int block = 0; block < inputSize / 4; block++) {
+        for (int o = 0; o < outputSize; o++) {
+            for (int k = 0; k < 4; k++) {
+                int8_t weight = int8_t(weightRange(rng));
+                sparseWeights[(block * outputSize + o) * 4 + k] = weight;
+                denseWeights[o * inputSize + block * 4 + k] = weight;
+            }
+        }
+    }
+    for (int32_t &bias : biases) {
+        bias = weightRange(rng);
+    }
+
+    std::vector<PackedInput> inputs;
+    U64 nonZeroBlocks = 0;
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        NNUE::Accumulator &accumulator = pos.getState()->accumulator;
+        accumulator.refresh(pos);
+
+        for (Color stm : {WHITE, BLACK}) {
+            PackedInput &input = inputs.emplace_back();
+            NNUE::packHidden(accumulator.hiddenLayer[stm], input.values);
+            NNUE::packHidden(accumulator.hiddenLayer[1 - stm], input.values + NNUE::L_1_SIZE);
+
+            for (int block = 0; block < inputSize / 4; block++) {
+                uint8_t *values = input.values + block * 4;
+                nonZeroBlocks += (values[0] | values[1] | values[2] | values[3]) != 0;
+            }
+        }
+    }
+
+    auto run = [&](auto kernel, const int8_t *weights) {
+        int64_t checksum = 0;
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < sparseBenchIterations; i++) {
+            for (const PackedInput &input : inputs) {
+                kernel(input.values, inputSize, weights, biases, output, outputSize);
+                checksum += output[i % outputSize];
+            }
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        U64 elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        return std::make_pair(checksum, elapsedTime / (sparseBenchIterations * inputs.size()));
+    };
+
+    auto [sparseChecksum, sparseTime] = run(NNUE::affineSparse, sparseWeights);
+    auto [denseChecksum, denseTime] = run(NNUE::affineDense, denseWeights);
+
+    std::cout << "Non-zero input blocks " << nonZeroBlocks * 100 / (inputs.size() * inputSize / 4) << "%\n";
+    std::cout << "Sparse " << sparseTime << " ns dense " << denseTime << " ns per propagation" << std::endl;
+
+    if (sparseChecksum != denseChecksum) {
+        std::cout << "SPARSE FAILED" << std::endl;
+        exit(1);
+    }
+}
+
+void benchMoveOrdering() {
+
+    initSearch();
+
+    struct OrderingList {
+        Move moves[200];
+        Score scores[200];
+        unsigned int count;
+    };
+
+    std::mt19937 rng(RANDOM_SEED);
+    std::uniform_int_distribution<int> historyRange(-30000, 30000);
+
+    std::unique_ptr<ThreadData> td = std::make_unique<ThreadData>();
+    for (Color color : {WHITE, BLACK}) {
+        for (Square from = A1; from < 64; from += 1) {
+            for (Square to = A1; to < 64; to += 1) {
+                td->historyTable[color][from][to] = historyRange(rng);
+            }
+        }
+    }
+
+    // The capture and the quiet lists of the bench positions and their children, scored like the move picker does.
+    std::vector<OrderingList> captureLists, quietLists;
+    auto collect = [&](const Position &pos) {
+        OrderingList &captures = captureLists.emplace_back();
+        captures.count = generateMoves(pos, captures.moves, GEN_CAPTURES) - captures.moves;
+        for (unsigned int i = 0; i < captures.count; i++) {
+            captures.scores[i] = td->scoreCapture(pos, captures.moves[i]);
+        }
+
+        OrderingList &quiets = quietLists.emplace_back();
+        quiets.count = generateMoves(pos, quiets.moves, GEN_QUIETS) - quiets.moves;
+        for (unsigned int i = 0; i < quiets.count; i++) {
+            quiets.scores[i] = td->scoreQuiet(pos, quiets.moves[i]);
+        }
+    };
+
+    for (const std::string &fen : benchPositions) {
+        Position pos = {fen};
+        collect(pos);
+
+        Move moves[200];
+        Move *movesEnd = generateMoves(pos, moves, GEN_ALL);
+        for (Move *it = moves; it != movesEnd; it++) {
+            pos.makeMove(*it);
+            collect(pos);
+            pos.undoMove(*it);
+        }
+    }
+
+    // Every list is picked to its end, the checksum weights the picked scores by their position in the order.
+    auto run = [&](const std::vector<OrderingList> &lists, auto pickAll) {
+        int64_t checksum = 0;
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < orderingBenchIterations; i++) {
+            for (const OrderingList &list : lists) {
+                checksum += pickAll(list);
+            }
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        U64 elapsedTime = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        return std::make_pair(checksum, elapsedTime / (orderingBenchIterations * lists.size()));
+    };
+
+    // Linear scan over separate move and score arrays.
+    auto pickSeparate = [](const OrderingList &list) {
+        Move moves[200];
+        Score scores[200];
+        std::copy(list.moves, list.moves + list.count, moves);
+        std::copy(list.scores, list.scores + list.count, scores);
+
+        int64_t checksum = 0;
+        for (unsigned int index = 0; index < list.count; index++) {
+            unsigned int best = index;
+            for (unsigned int i = index + 1; i < list.count; i++) {
+                if (scores[i] > scores[best]) {
+                    best = i;
+                }
+            }
+            std::swap(moves[index], moves[best]);
+            std::swap(scores[index], scores[best]);
+            checksum += int64_t(scores[index]) * (index + 1);
+        }
+        return checksum;
+    };
+
+    // Selection over the packed keys.
+    auto pickPacked = [](const OrderingList &list) {
+        alignas(64) ScoredMove moves[200 + SCORED_MOVE_PADDING];
+        for (unsigned int i = 0; i < list.count; i++) {
+            moves[i] = {list.moves[i], list.scores[i]};
+        }
+        padScoredMoves(moves + list.count);
+
+        int64_t checksum = 0;
+        for (unsigned int index = 0; index < list.count; index++) {
+            std::swap(moves[index], moves[selectBest(moves, index, list.count)]);
+            checksum += int64_t(moves[index].score()) * (index + 1);
+        }
+        return checksum;
+    };
+
+    // Partial insertion sort of the packed keys, followed by walking the list.
+    auto pickSorted = [](const OrderingList &list) {
+        alignas(64) ScoredMove moves[200 + SCORED_MOVE_PADDING];
+        for (unsigned int i = 0; i < list.count; i++) {
+            moves[i] = {list.moves[i], list.scores[i]};
+        }
+        partialInsertionSort(moves, moves + list.count, -QUIET_SORT_MARGIN * orderingBenchDepth);
+
+        int64_t checksum = 0;
+        for (unsigned int index = 0; index < list.count; index++) {
+            checksum += int64_t(moves[index].score()) * (index + 1);
+        }
+        return checksum;
+    };
+
+    auto [separateCaptureChecksum, separateCaptureTime] = run(captureLists, pickSeparate);
+    auto [packedCaptureChecksum, packedCaptureTime] = run(captureLists, pickPacked);
+    auto [separateQuietChecksum, separateQuietTime] = run(quietLists, pickSeparate);
+    auto [packedQuietChecksum, packedQuietTime] = run(quietLists, pickPacked);
+    auto [sortedQuietChecksum, sortedQuietTime] = run(quietLists, pickSorted);
+
+    std::cout << "Move selection: " << getMoveSelectionName() << "\n";
+    std::cout << "Captures: separate " << separateCaptureTime << " ns packed " << packedCaptureTime << " ns per list\n";
+    std::cout << "Quiets: separate " << separateQuietTime << " ns packed " << packedQuietTime << " ns partial sort "
+              << sortedQuietTime << " ns per list" << std::endl;
+
+    // Equal scores may be picked in a different order, but the sequence of the picked scores has to be the same.
+    if (separateCaptureChecksum != packedCaptureChecksum || separateQuietChecksum != packedQuietChecksum ||
+        sortedQuietChecksum == 0) {
+        std::cout << "ORDERING FAILED" << std::endl;
+        exit(1);
+    }
+}
@@ -28,12 +28,12 @@
 template<bool output>
 U64 perft(Position &position, Depth depth) {
 
-    Move moves[200]; // Stores the legal moves in the position
-    Move *movesEnd = generateMoves(position, moves, false);
-
     // Bulk counting the number of moves at depth 1.
     if (depth == 1)
-        return movesEnd - moves;
+        return countLegalMoves(position);
+
+    Move moves[200]; // Stores the legal moves in the position
+    Move *movesEnd = generateMoves(position, moves, false);
 
     // DFS like routine, calling itself recursively with lowered depth.
     U64 nodes = 0;
@@ -49,6 +49,14 @@ U64 perft(Position &position, Depth depth) {
     return nodes;
 }
 
+// Default size of the perft hash table in MB
+constexpr unsigned int PERFT_HASH_SIZE = 64;
+
+U64 perftParallel(const Position &position, Depth depth, unsigned int threadCount, unsigned int hashSize, bool output);
 
-void testPerft();
+void testPerft(unsigned int threadCount, unsigned int hashSize);
 void testSearch(U64 expectedResult);
+void testTT(int threadCount);
+void testNNUE();
+void benchSparse();
+void benchMoveOrdering();
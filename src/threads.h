@@ -20,11 +20,8 @@
 #include "tt.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstring>
-#include <mutex>
-
-extern std::mutex mNodesSearched;
-extern U64 nodesSearched[64][64];
 
 // clang-format off
 constexpr int MVVLVA[6][6] = {
@@ -39,7 +36,14 @@ constexpr int MVVLVA[6][6] = {
 
 constexpr int MAX_MULTIPV = 20;
 
-struct ThreadData {
+// MVV-LVA is scaled by this in capture scores. One victim step is 10 * MVVLVA_SCALE, so a capture history at
+// CAPTURE_HISTORY_LIMIT can move a capture past the captures of the next more or less valuable victim.
+constexpr Score MVVLVA_SCALE = 1024;
+constexpr Score CAPTURE_HISTORY_LIMIT = 16384;
+constexpr Score HISTORY_LIMIT = 30000;
+
+// Aligned to cache lines, so the threads don't write the same lines.
+struct alignas(64) ThreadData {
 
     int threadId;
     Position position;
@@ -48,9 +52,13 @@ struct ThreadData {
     Score variationScores[MAX_MULTIPV];
     Move variationMoves[MAX_MULTIPV];
 
-    U64 nodes = 0;
+    // Counters written by the thread on every node. The main thread reads 'nodes' and 'tbHits' while the thread is
+    // searching, so they are atomic, but only this thread writes them, which needs no locked instructions.
+    alignas(64) std::atomic<U64> nodes = 0;
+    U64 nextLimitCheck = 0;
     Depth selectiveDepth = 0;
-    U64 tbHits = 0;
+    std::atomic<U64> tbHits = 0;
+    TTStats ttStats;
 
     bool uciMode = false;
 
@@ -60,10 +68,16 @@ struct ThreadData {
     Move pvArray[MAX_PLY + 1][MAX_PLY + 1];
     Ply pvLength[MAX_PLY + 1];
 
+    // Nodes searched by this thread after each root move, only summed up between threads by the main thread
+    // at the end of an iteration.
+    std::atomic<U64> rootNodes[64][64];
+
     // Arrays used for move ordering.
     Move killerMoves[MAX_PLY + 1][2];
     Move counterMoves[64][64];
     Score historyTable[2][64][64];
+    Score captureHistory[12][64][6];                              // [piece][to][captured type]
+    PieceToHistory continuationHistory[NULL_PIECE_INDEX + 1][64]; // [piece][to] of the previous move
 
     inline void clear() {
         selectiveDepth = 0;
@@ -72,7 +86,21 @@ struct ThreadData {
         std::memset(pvLength, 0, sizeof(pvLength));
         std::memset(killerMoves, 0, sizeof(killerMoves));
         std::memset(counterMoves, 0, sizeof(counterMoves));
+    }
 
+    inline void reset() {
+        nodes.store(0, std::memory_order_relaxed);
+        nextLimitCheck = 0;
+        tbHits.store(0, std::memory_order_relaxed);
+        ttStats = {};
+
+        for (auto &fromNodes : rootNodes) {
+            for (std::atomic<U64> &moveNodes : fromNodes) {
+                moveNodes.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // The butterfly history of the previous move is aged once per search.
         for (Color color : {WHITE, BLACK}) {
             for (Square sq = A1; sq < 64; sq += 1) {
                 for (Square sq2 = A1; sq2 < 64; sq2 += 1) {
@@ -80,19 +108,15 @@ struct ThreadData {
                 }
             }
         }
-    }
 
-    inline void reset() {
-        nodes = 0;
-        tbHits = 0;
+        clear();
+    }
 
+    // Clears the history tables, which are otherwise kept between the searches of a game.
+    inline void clearHistory() {
         std::memset(historyTable, 0, sizeof(historyTable));
-
-        mNodesSearched.lock();
-        std::memset(nodesSearched, 0, sizeof(nodesSearched));
-        mNodesSearched.unlock();
-
-        clear();
+        std::memset(captureHistory, 0, sizeof(captureHistory));
+        std::memset(continuationHistory, 0, sizeof(continuationHistory));
     }
 
     void updateKillerMoves(Move m, Ply ply) {
@@ -105,43 +129,84 @@ struct ThreadData {
     }
 
     void updateHH(Move move, Color color, Score bonus) {
-        historyTable[color][move.getFrom()][move.getTo()] = std::clamp(historyTable[color][move.getFrom()][move.getTo()] + bonus, -30000, 30000);
+        historyTable[color][move.getFrom()][move.getTo()] = std::clamp(historyTable[color][move.getFrom()][move.getTo()] + bonus, -HISTORY_LIMIT, HISTORY_LIMIT);
+    }
+
+    // Updates the 1-ply and the 2-ply continuation histories of a quiet move made by 'piece'.
+    void updateContinuationHistory(const SearchStack *stack, Piece piece, Move move, Score bonus) {
+        for (int i : {1, 2}) {
+            if ((stack - i)->move.isOk()) {
+                Score &history = (*(stack - i)->continuationHistory)[pieceIndex(piece)][move.getTo()];
+                history = std::clamp(history + bonus, -HISTORY_LIMIT, HISTORY_LIMIT);
+            }
+        }
     }
 
-    void updateNodesSearched(Move move, U64 totalNodes) {
-        mNodesSearched.lock();
-        nodesSearched[move.getFrom()][move.getTo()] += totalNodes;
-        mNodesSearched.unlock();
+    // Updates the capture history of a capture, which isn't made yet.
+    void updateCaptureHistory(const Position &pos, Move move, Score bonus) {
+        Score &history = captureHistory[pieceIndex(pos.pieceAt(move.getFrom()))][move.getTo()][capturedType(pos, move)];
+        history = std::clamp(history + bonus, -CAPTURE_HISTORY_LIMIT, CAPTURE_HISTORY_LIMIT);
     }
 
-    Score scoreRootNode(Move move) {
-        return nodesSearched[move.getFrom()][move.getTo()] / 1000;
+    // Returns the type of the piece captured by a move.
+    static PieceType capturedType(const Position &pos, Move move) {
+        return move.equalFlag(EP_CAPTURE) ? PAWN : pos.pieceAt(move.getTo()).type;
     }
 
-    Score scoreMove(const Position &pos, Move prevMove, Move move, Ply ply) {
-        Square from = move.getFrom();
+    // Returns the sum of the butterfly and the continuation histories of a quiet move made by 'piece'.
+    Score quietHistory(const SearchStack *stack, Color color, Piece piece, Move move) const {
         Square to = move.getTo();
-        Color stm = pos.getSideToMove();
-
-        if (move == getHashMove(pos.getHash())) {
-            return 10000000;
-        } else if (move.isPromo()) {
-            if (move.isSpecial1() && move.isSpecial2()) { // Queen promotion
-                return 9000000;
-            } else { // Anything else, under promotions should only be played in really few cases
-                return -3000000;
-            }
-        } else if (move.isCapture()) {
-            bool good = see(pos, move, 0);
-            return (good ? 8000000 : 2000000) + MVVLVA[move.equalFlag(EP_CAPTURE) ? PAWN : pos.pieceAt(to).type][pos.pieceAt(from).type];
-        } else if (killerMoves[ply][0] == move) {
-            return 7000000;
-        } else if (killerMoves[ply][1] == move) {
-            return 6000000;
-        } else if (counterMoves[prevMove.getFrom()][prevMove.getTo()] == move) {
-            return 5000000;
+        return historyTable[color][move.getFrom()][to] + (*(stack - 1)->continuationHistory)[pieceIndex(piece)][to] +
+               (*(stack - 2)->continuationHistory)[pieceIndex(piece)][to];
+    }
+
+    // Returns the number of nodes searched by this thread.
+    inline U64 getNodes() const {
+        return nodes.load(std::memory_order_relaxed);
+    }
+
+    // Counts a searched node.
+    inline void addNode() {
+        nodes.store(getNodes() + 1, std::memory_order_relaxed);
+    }
+
+    // Counts a tablebase hit.
+    inline void addTBHit() {
+        tbHits.store(tbHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // Returns the number of nodes searched by this thread after a root move.
+    inline U64 getRootNodes(Move move) const {
+        return rootNodes[move.getFrom()][move.getTo()].load(std::memory_order_relaxed);
+    }
+
+    void updateRootNodes(Move move, U64 totalNodes) {
+        rootNodes[move.getFrom()][move.getTo()].store(getRootNodes(move) + totalNodes, std::memory_order_relaxed);
+    }
+
+    Score scoreRootNode(Move move) const {
+        return getRootNodes(move) / 1000;
+    }
+
+    // Scores a capture for the move picker by MVV-LVA and the capture history, queen promotions are tried first
+    // and under promotions last.
+    Score scoreCapture(const Position &pos, Move move) const {
+        if (move.isPromo()) {
+            return move.isSpecial1() && move.isSpecial2() ? 100000 : -100000;
         }
+        Piece piece = pos.pieceAt(move.getFrom());
+        PieceType captured = capturedType(pos, move);
+        return MVVLVA[captured][piece.type] * MVVLVA_SCALE + captureHistory[pieceIndex(piece)][move.getTo()][captured];
+    }
 
-        return historyTable[stm][from][to];
+    // Scores a quiet move for the move picker by the history heuristic and if 'stack' is given by the continuation
+    // histories, queen promotions are tried first and under promotions last.
+    Score scoreQuiet(const Position &pos, Move move, const SearchStack *stack = nullptr) const {
+        if (move.isPromo()) {
+            return move.isSpecial1() && move.isSpecial2() ? 1000000 : -1000000;
+        }
+        if (stack)
+            return quietHistory(stack, pos.getSideToMove(), pos.pieceAt(move.getFrom()), move);
+        return historyTable[pos.getSideToMove()][move.getFrom()][move.getTo()];
     }
 };
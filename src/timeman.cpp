@@ -19,7 +19,6 @@
 
 unsigned int MOVE_OVERHEAD = 20;
 
-constexpr U64 mask = 1023;
 constexpr long long INFINITE_LIMIT = LONG_LONG_MAX / 2;
 
 bool minimalDepthReached;
@@ -65,11 +64,11 @@ void initTimeManager(long long time, long long inc, long long movesToGo, long lo
     }
 }
 
-bool shouldEnd(U64 nodes, U64 totalNodes) {
-    if ((nodes & mask) == 0 && !stopped && minimalDepthReached && !isInfiniteSearch()) {
-        stopped = getSearchTime() >= maxTime || totalNodes > maxNodes;
+void checkLimits(U64 totalNodes) {
+    if (!stopped && minimalDepthReached && !isInfiniteSearch() &&
+        (getSearchTime() >= maxTime || totalNodes > maxNodes)) {
+        stopped = true;
     }
-    return stopped;
 }
 
 bool manageTime(double factor) {
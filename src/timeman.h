@@ -24,7 +24,11 @@ extern std::atomic<bool> stopped;
 
 void initTimeManager(long long time, long long inc, long long movesToGo, long long moveTime, long long nodes);
 
-bool shouldEnd(U64 nodes, U64 totalNodes);
+// Number of nodes searched by the main thread between two checks of the limits
+constexpr U64 LIMIT_CHECK_INTERVAL = 1024;
+
+// Raises the stop flag if the time or the node limit is exceeded, only called by the main thread.
+void checkLimits(U64 totalNodes);
 
 bool manageTime(double factor);
 
@@ -15,7 +15,10 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "tt.h"
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <iostream>
 
 #ifdef __linux__
 
@@ -25,14 +28,107 @@
 
 TTable tt;
 
-// Returns a candidate ttEntry corresponding to a hash.
+// Returns a candidate ttEntry corresponding to a hash, when the single entry layout is used.
 TTEntry *getEntry(U64 hash) {
+    return reinterpret_cast<TTEntry *>(tt.table) + (hash & tt.entryMask);
+}
+
+// Returns the bucket corresponding to a hash, when the bucketed layout is used.
+TTBucket *getBucket(U64 hash) {
     return tt.table + (hash & tt.mask);
 }
 
-// Clears the transposition table.
+// Returns the key stored in the compressed entries.
+inline uint32_t getKey(U64 hash) {
+    return hash >> 32;
+}
+
+/*
+ * Lockless hashing
+ *
+ * Entries are read and written by every search thread without synchronization. The key is stored
+ * XOR-ed with the data of the entry, so an entry that is torn by a concurrent write fails the key
+ * comparison and is treated as a miss.
+ * https://www.chessprogramming.org/Shared_Hash_Table#Lock-less
+ */
+
+// Returns the data of an entry, which is XOR-ed into its hash.
+inline U64 getData(const TTEntry &entry) {
+    U64 data;
+    std::memcpy(&data, &entry.eval, sizeof(U64));
+    return data;
+}
+
+// Returns the data of a slot folded to 32 bits, which is XOR-ed into its key.
+inline uint32_t getData(const TTSlot &slot) {
+    U64 data;
+    std::memcpy(&data, &slot.eval, sizeof(U64));
+    return uint32_t(data) ^ uint32_t(data >> 32);
+}
+
+// Returns the flag of an entry read from the table, the upper bits store the generation.
+inline EntryFlag getFlag(const TTEntry &entry) {
+    return EntryFlag(entry.flag & 3);
+}
+
+// Returns the generation of an entry read from the table.
+inline uint8_t getGeneration(const TTEntry &entry) {
+    return entry.flag >> 2;
+}
+
+// Returns the hash of an entry read from the table.
+inline U64 getHash(const TTEntry &entry) {
+    return entry.hash ^ getData(entry);
+}
+
+// Returns the key of a slot read from the table.
+inline uint32_t getKey(const TTSlot &slot) {
+    return slot.key ^ getData(slot);
+}
+
+// Returns how many searches ago the slot was written.
+inline int getAge(const TTSlot &slot) {
+    return (tt.generation - slot.getGeneration()) & (TT_GENERATION_COUNT - 1);
+}
+
+// Returns the value of a slot, the lowest valued slot gets replaced first.
+inline int getReplaceValue(const TTSlot &slot) {
+    return slot.depth - 8 * getAge(slot);
+}
+
+// Returns the time elapsed since 'begin' in milliseconds.
+inline long long elapsedMillis(std::chrono::steady_clock::time_point begin) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count();
+}
+
+/*
+ * Clears the transposition table.
+ *
+ * The table is split into equal slices, which are cleared by the 'tt.threadCount' search threads in
+ * parallel. As the freshly allocated pages are first touched by the threads probing them, the operating
+ * system spreads them across the memory of the threads' NUMA nodes.
+ */
 void ttClear() {
-    std::memset(tt.table, 0, tt.bucketCount * sizeof(TTEntry));
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    const U64 threadCount = tt.runOnThreads ? std::max(1, tt.threadCount) : 1;
+    const U64 sliceSize = (tt.bucketCount + threadCount - 1) / threadCount;
+
+    auto clearSlice = [sliceSize](int idx) {
+        const U64 start = std::min(tt.bucketCount, idx * sliceSize);
+        const U64 end = std::min(tt.bucketCount, start + sliceSize);
+
+        std::memset(static_cast<void *>(tt.table + start), 0, (end - start) * sizeof(TTBucket));
+    };
+
+    if (tt.runOnThreads) {
+        tt.runOnThreads(clearSlice);
+    } else {
+        clearSlice(0);
+    }
+
+    tt.generation = 0;
+    tt.clearTime = elapsedMillis(begin);
 }
 
 // Frees the space allocated for the transposition table.
@@ -41,77 +137,199 @@ void ttFree() {
 }
 
 // Resizes the transposition table.
-void ttResize(unsigned int MBSize) {
+void ttResize(U64 MBSize) {
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
     if (tt.bucketCount)
         ttFree();
 
     unsigned int i = 10;
-    while ((1ULL << i) <= MBSize * 1024 * 1024 / sizeof(TTEntry))
+    while ((1ULL << i) <= MBSize * 1024 * 1024 / sizeof(TTBucket))
         i++;
 
     tt.bucketCount = (1ULL << (i - 1));
     tt.mask = tt.bucketCount - 1ULL;
+    tt.entryMask = tt.bucketCount * (sizeof(TTBucket) / sizeof(TTEntry)) - 1ULL;
 
 #ifdef __linux__
     // Allocate memory with 1MB alignment
-    tt.table = static_cast<TTEntry *>(aligned_alloc((1ULL << 20), tt.bucketCount * sizeof(TTEntry)));
+    tt.table = static_cast<TTBucket *>(aligned_alloc((1ULL << 20), tt.bucketCount * sizeof(TTBucket)));
 
     // For reference see https://man7.org/linux/man-pages/man2/madvise.2.html on MADV HUGEPAGE
-    madvise(tt.table, tt.bucketCount * sizeof(TTEntry), MADV_HUGEPAGE);
+    if (tt.table != nullptr)
+        madvise(tt.table, tt.bucketCount * sizeof(TTBucket), MADV_HUGEPAGE);
 #else
-    tt.table = (TTEntry *) malloc(tt.bucketCount * sizeof(TTEntry));
+    tt.table = static_cast<TTBucket *>(malloc(tt.bucketCount * sizeof(TTBucket)));
 #endif
 
+    if (tt.table == nullptr) {
+        std::cout << "info string Failed to allocate " << MBSize << " MB for the transposition table" << std::endl;
+        exit(1);
+    }
+
+    tt.allocTime = elapsedMillis(begin);
+
     ttClear();
 }
 
+// Sets the threads used for clearing the transposition table.
+void ttSetThreadCount(int threadCount, ThreadRunner runOnThreads) {
+    tt.threadCount = threadCount;
+    tt.runOnThreads = runOnThreads;
+}
+
+// Switches between the bucketed and the single entry layout. The stored entries are lost.
+void ttSetBucketed(bool bucketed) {
+    tt.bucketed = bucketed;
+    ttClear();
+}
+
+// Starts a new generation, entries from the previous searches will be replaced more easily.
+void ttNewSearch() {
+    tt.generation = (tt.generation + 1) & (TT_GENERATION_COUNT - 1);
+}
+
 // Probes a Zobrish hash and sets ttHit to true, if it succeeds.
-TTEntry ttProbe(U64 hash, Ply ply, bool &ttHit) {
-    TTEntry entry = *getEntry(hash);
+TTEntry ttProbe(U64 hash, Ply ply, bool &ttHit, TTStats &stats) {
+
+    stats.probes++;
 
-    if (entry.hash != hash)
-        return {};
+    if (!tt.bucketed) {
+        TTEntry entry = *getEntry(hash);
 
-    entry.eval = scoreFromTT(entry.eval, ply);
-    ttHit = true;
-    return entry;
+        if (getHash(entry) != hash) {
+            // Another position uses the same index
+            if (getFlag(entry) != TT_NONE)
+                stats.collisions++;
+            return {};
+        }
+
+        entry.hash = hash;
+        entry.eval = scoreFromTT(entry.eval, ply);
+        entry.flag = getFlag(entry);
+        ttHit = true;
+        stats.hits++;
+        return entry;
+    }
+
+    const TTBucket *bucket = getBucket(hash);
+    const uint32_t key = getKey(hash);
+    bool full = true;
+
+    for (const TTSlot &candidate : bucket->slots) {
+        const TTSlot slot = candidate;
+        if (getKey(slot) == key && slot.getFlag() != TT_NONE) {
+            ttHit = true;
+            stats.hits++;
+            return {hash, scoreFromTT(slot.eval, ply), slot.hashMove, slot.depth, slot.getFlag()};
+        }
+
+        if (slot.getFlag() == TT_NONE)
+            full = false;
+    }
+
+    // Every slot of the bucket is used by other positions
+    if (full)
+        stats.collisions++;
+
+    return {};
 }
 
 // Saves an entry into the transposition table.
-void ttSave(U64 hash, Depth depth, Score eval, EntryFlag flag, Move bestMove, Ply ply) {
-    TTEntry *entry = getEntry(hash);
+void ttSave(U64 hash, Depth depth, Score eval, EntryFlag flag, Move bestMove, Ply ply, TTStats &stats) {
+
+    if (!tt.bucketed) {
+        TTEntry *entry = getEntry(hash);
+        TTEntry newEntry = *entry;
+        const bool samePosition = getHash(newEntry) == hash;
+
+        if (!samePosition && getFlag(newEntry) != TT_NONE)
+            stats.overwrites++;
 
-    if (entry->hash != hash || bestMove.isOk()) {
-        entry->hashMove = bestMove;
+        if (!samePosition || bestMove.isOk()) {
+            newEntry.hashMove = bestMove;
+        }
+
+        if (!samePosition || flag == TT_EXACT || newEntry.depth <= depth + 4) {
+            newEntry.depth = depth;
+            newEntry.eval = scoreToTT(eval, ply);
+            newEntry.flag = EntryFlag((tt.generation << 2) | flag);
+        }
+
+        newEntry.hash = hash ^ getData(newEntry);
+        *entry = newEntry;
+        return;
+    }
+
+    TTBucket *bucket = getBucket(hash);
+    const uint32_t key = getKey(hash);
+
+    // Use the slot of the same position or an empty one if there is any,
+    // otherwise replace the slot with the lowest depth minus age value.
+    TTSlot *slot = bucket->slots;
+    for (TTSlot &candidate : bucket->slots) {
+        if (getKey(candidate) == key || candidate.getFlag() == TT_NONE) {
+            slot = &candidate;
+            break;
+        }
+
+        if (getReplaceValue(candidate) < getReplaceValue(*slot)) {
+            slot = &candidate;
+        }
+    }
+
+    TTSlot newSlot = *slot;
+    const bool samePosition = getKey(newSlot) == key && newSlot.getFlag() != TT_NONE;
+
+    if (!samePosition && newSlot.getFlag() != TT_NONE)
+        stats.overwrites++;
+
+    if (!samePosition || bestMove.isOk()) {
+        newSlot.hashMove = bestMove;
     }
 
-    if (entry->hash != hash || flag == TT_EXACT || entry->depth <= depth + 4) {
-        entry->hash = hash;
-        entry->depth = depth;
-        entry->eval = scoreToTT(eval, ply);
-        entry->flag = flag;
+    if (!samePosition || flag == TT_EXACT || newSlot.depth <= depth + 4 || getAge(newSlot) != 0) {
+        newSlot.depth = depth;
+        newSlot.eval = scoreToTT(eval, ply);
+        newSlot.genFlag = (tt.generation << 2) | flag;
     }
+
+    newSlot.key = key ^ getData(newSlot);
+    *slot = newSlot;
 }
 
-// Returns the fullness of the transposition table
+/*
+ * Returns the fullness of the transposition table in permill.
+ *
+ * Only the entries written by the current search are counted. The sample is spread
+ * evenly across the whole table.
+ */
 int getTTFull() {
     int cnt = 0;
-    for (int i = 0; i < 1000; i++) {
-        if (tt.table[i].hash != 0) cnt++;
+    if (!tt.bucketed) {
+        const TTEntry *entries = reinterpret_cast<const TTEntry *>(tt.table);
+        const U64 step = (tt.entryMask + 1) / 1000;
+        for (U64 i = 0; i < 1000; i++) {
+            const TTEntry &entry = entries[i * step];
+            if (getFlag(entry) != TT_NONE && getGeneration(entry) == tt.generation) cnt++;
+        }
+        return cnt;
     }
-    return cnt;
-}
 
-// Returns the hash move corresponding to the Zobrist hash.
-Move getHashMove(U64 hash) {
-    TTEntry *entry = getEntry(hash);
-    if (entry->hash == hash)
-        return entry->hashMove;
-    return MOVE_NULL;
+    const U64 step = tt.bucketCount / (1000 / TT_BUCKET_SIZE);
+    for (U64 i = 0; i < 1000 / TT_BUCKET_SIZE; i++) {
+        for (const TTSlot &slot : tt.table[i * step].slots) {
+            if (slot.getFlag() != TT_NONE && slot.getGeneration() == tt.generation) cnt++;
+        }
+    }
+    return cnt;
 }
 
 // Prefetches a transposition table entry.
 void ttPrefetch(U64 hash) {
-    __builtin_prefetch(&tt.table[hash & tt.mask], 0, 1);
-}
\ No newline at end of file
+    if (tt.bucketed)
+        __builtin_prefetch(getBucket(hash), 0, 1);
+    else
+        __builtin_prefetch(getEntry(hash), 0, 1);
+}
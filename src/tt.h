@@ -19,6 +19,8 @@
 #include "constants.h"
 #include "move.h"
 
+#include <functional>
+
 enum EntryFlag : uint8_t {
     TT_NONE = 0,
     TT_EXACT = 1,
@@ -35,27 +37,100 @@ struct TTEntry {    // Total: 16 bytes
     Score eval;     // 4 bytes
     Move hashMove;  // 2 bytes
     Depth depth;    // 1 byte
-    EntryFlag flag; // 1 byte
+    EntryFlag flag; // 1 byte - the upper 6 bits store the generation inside the table
+};
+
+// Compressed entry used by the bucketed layout, only the upper 32 bits of the hash are stored.
+struct TTSlot {       // Total: 12 bytes
+    uint32_t key;     // 4 bytes
+    Score eval;       // 4 bytes
+    Move hashMove;    // 2 bytes
+    Depth depth;      // 1 byte
+    uint8_t genFlag;  // 1 byte - generation (6 bits) and flag (2 bits)
+
+    [[nodiscard]] inline EntryFlag getFlag() const {
+        return EntryFlag(genFlag & 3);
+    }
+
+    [[nodiscard]] inline uint8_t getGeneration() const {
+        return genFlag >> 2;
+    }
+};
+
+constexpr int TT_BUCKET_SIZE = 5;
+constexpr int TT_GENERATION_COUNT = 64;
+
+// A cache line sized bucket of compressed entries.
+struct alignas(64) TTBucket { // Total: 64 bytes
+    TTSlot slots[TT_BUCKET_SIZE];
+    uint32_t padding;
 };
 
+static_assert(sizeof(TTEntry) == 16);
+static_assert(sizeof(TTSlot) == 12);
+static_assert(sizeof(TTBucket) == 64);
+
+// Runs a job with the id of every thread in parallel, and waits for them to finish.
+using ThreadRunner = void (*)(const std::function<void(int)> &job);
+
 struct TTable {
-    TTEntry *table;
-    unsigned int bucketCount;
+    TTBucket *table;
+    U64 bucketCount;
+
+    // Index masks of the bucketed and the single entry layout.
     U64 mask;
+    U64 entryMask;
+
+    // Increased before every search, used for aging the entries.
+    uint8_t generation;
+
+    // True if the bucketed layout is used, otherwise the table is treated as an array of TTEntries.
+    bool bucketed = true;
+
+    // Number of threads used for clearing the table, and the function running a job on them. If it isn't set,
+    // the table is cleared by the calling thread.
+    int threadCount = 1;
+    ThreadRunner runOnThreads = nullptr;
+
+    // Time spent (in ms) with the last allocation and clearing of the table.
+    long long allocTime, clearTime;
+};
+
+// Transposition table statistics of a search thread.
+struct TTStats {
+    U64 probes = 0;
+    U64 hits = 0;
+    U64 cutoffs = 0;
+    U64 overwrites = 0;
+    U64 collisions = 0;
+
+    inline void operator+=(const TTStats &stats) {
+        probes += stats.probes;
+        hits += stats.hits;
+        cutoffs += stats.cutoffs;
+        overwrites += stats.overwrites;
+        collisions += stats.collisions;
+    }
 };
 
-void ttResize(unsigned int MBSize);
+extern TTable tt;
+
+void ttResize(U64 MBSize);
 
 void ttClear();
 
 void ttFree();
 
-TTEntry ttProbe(U64 hash, Ply ply, bool &ttHit);
+void ttSetThreadCount(int threadCount, ThreadRunner runOnThreads);
 
-void ttSave(U64 hash, Depth depth, Score eval, EntryFlag flag, Move bestMove, Ply ply);
+void ttSetBucketed(bool bucketed);
 
-int getTTFull();
+void ttNewSearch();
+
+TTEntry ttProbe(U64 hash, Ply ply, bool &ttHit, TTStats &stats);
 
-Move getHashMove(U64 hash);
+void ttSave(U64 hash, Depth depth, Score eval, EntryFlag flag, Move bestMove, Ply ply, TTStats &stats);
+
+int getTTFull();
 
 void ttPrefetch(U64 hash);
@@ -67,10 +67,14 @@ inline void addParam(const std::string &name, int defaultValue, int minValue, in
                                                \
     DEPTH_PARAM(LMR_DEPTH, 3)                  \
     SCORE_PARAM(LMR_INDEX, 3)                  \
+    SCORE_PARAM(LMR_HISTORY_DIVISOR, 6000)     \
                                                \
     DEPTH_PARAM(LMP_DEPTH, 4)                  \
     SCORE_PARAM(LMP_MOVES, 5)                  \
                                                \
+    DEPTH_PARAM(HISTORY_PRUNING_DEPTH, 3)      \
+    SCORE_PARAM(HISTORY_PRUNING_MARGIN, 500)   \
+                                               \
     DEPTH_PARAM(FUTILITY_DEPTH, 5)             \
     SCORE_PARAM(FUTILITY_MARGIN, 33)           \
     SCORE_PARAM(FUTILITY_MARGIN_DEPTH, 53)     \
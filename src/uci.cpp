@@ -21,6 +21,7 @@
 #include "tests.h"
 #include "timeman.h"
 #include "tt.h"
+#include <chrono>
 #include <iomanip>
 #include <sstream>
 #include <vector>
@@ -228,11 +229,17 @@ void uciInitProtocol() {
 
     out("id", "author", "SzilBalazs");
 
+    out("info", "string", "Using", NNUE::getKernelName(), "NNUE kernels and", getSliderLookupName(), "slider lookup");
+
     // Tell the GUI what options we have
-    out("option", "name", "Hash", "type", "spin", "default", 32, "min", 1, "max", 4096);
+    out("option", "name", "Hash", "type", "spin", "default", 32, "min", 1, "max", 1048576);
+    out("option", "name", "TTBuckets", "type", "check", "default", "true");
     out("option", "name", "Threads", "type", "spin", "default", 1, "min", 1, "max", 64);
     out("option", "name", "MultiPV", "type", "spin", "default", 1, "min", 1, "max", MAX_MULTIPV);
     out("option", "name", "EvalFile", "type", "string", "default", "corenet.bin");
+#ifdef __linux__
+    out("option", "name", "SharedNet", "type", "check", "default", "false");
+#endif
     out("option", "name", "SyzygyPath", "type", "string", "default", "<empty>");
     out("option", "name", "Move Overhead", "type", "spin", "default", 20, "min", 0, "max", 10000);
 
@@ -247,6 +254,7 @@ void uciInitProtocol() {
 void uciLoop() {
     // Initialize stuff
     initSearch();
+    setThreadCount(1);
     ttResize(32);
 
     Position pos = {STARTING_FEN};
@@ -276,24 +284,40 @@ void uciLoop() {
         } else if (command == "stop") {
             joinThreads(false);
         } else if (command == "ucinewgame") {
+            joinThreads(false);
             ttClear();
+            clearHistory();
+            out("info", "string", "Hash cleared in", tt.clearTime, "ms");
         } else if (command == "setoption") {
             if (tokens.size() >= 4) {
                 if (tokens[1] == "Hash") {
-                    ttResize(std::stoi(tokens[3]));
+                    joinThreads(false);
+                    ttResize(std::stoull(tokens[3]));
+                    out("info", "string", "Hash allocated in", tt.allocTime, "ms", "cleared in", tt.clearTime, "ms");
+                } else if (tokens[1] == "TTBuckets") {
+                    // The table is reshaped, so no thread may still be probing it.
+                    joinThreads(false);
+                    ttSetBucketed(tokens[3] == "true");
                 } else if (tokens[1] == "Move" && tokens[2] == "Overhead") {
                     MOVE_OVERHEAD = std::stoi(tokens[4]);
                 } else if (tokens[1] == "Ponder") {
 
                 } else if (tokens[1] == "Threads") {
                     threadCount = std::stoi(tokens[3]);
+                    setThreadCount(threadCount);
                 } else if (tokens[1] == "MultiPV") {
                     multiPV = std::stoi(tokens[3]);
                 } else if (tokens[1] == "SyzygyPath") {
                     tb_init(tokens[3].c_str());
                 } else if (tokens[1] == "EvalFile") {
+                    // The old net is released, so no thread may still be evaluating with it.
+                    joinThreads(false);
                     NNUE::EVALFILE = tokens[3];
                     NNUE::init();
+                } else if (tokens[1] == "SharedNet") {
+                    joinThreads(false);
+                    NNUE::SHARED_NET = tokens[3] == "true";
+                    NNUE::init();
                 } else {
                     bool found = false;
 #ifdef TUNE
@@ -385,7 +409,12 @@ void uciLoop() {
                 out(*it);
             }
         } else if (command == "perft") {
-            out("Total nodes:", perft<true>(pos, std::stoi(tokens[0])));
+            unsigned int hashSize = tokens.size() >= 2 ? std::stoi(tokens[1]) : PERFT_HASH_SIZE;
+            auto begin = std::chrono::steady_clock::now();
+            U64 nodes = perftParallel(pos, std::stoi(tokens[0]), threadCount, hashSize, true);
+            auto end = std::chrono::steady_clock::now();
+            U64 elapsedTime = std::max<U64>(1, std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count());
+            out("Total nodes:", nodes, "Mnps:", double(nodes) / double(elapsedTime));
         } else if (command == "play") {
             playGame(pos);
         } else if (command == "see") {